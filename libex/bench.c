@@ -0,0 +1,939 @@
+/*
+ * Micro-benchmarks for the libex extensions.
+ *
+ * Build with optimisations and every opt-in source enabled, then run all
+ * benchmarks or only the named ones:
+ *
+ *   cc -O2 -pthread bench.c -o bench
+ *   ./bench [name...]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#define LIBEX_DEADLINE
+#define LIBEX_CANCEL
+#include "libex.h"
+#include "libex_parallel.h"
+#include "libex_arena.h"
+#include "libex_txn.h"
+#include "libex_groupcommit.h"
+#include "libex_transfer.h"
+#include "libex_signal.h"
+#include "libex_writer.h"
+#include "libex_batch.h"
+#include <netinet/in.h>
+#include "libex_loop.h"
+#include <fcntl.h>
+#include "libex_walk.h"
+#include <ftw.h>
+#include "libex_spawn.h"
+#include <spawn.h>
+/* the echo server and load generator, which also provides now_ns */
+#define ECHO_NO_MAIN
+#include "echo.c"
+
+/* keeps the compiler from folding the benchmarked checks away */
+static volatile int sink;
+
+#define CHECKS 100000000
+
+/* the baseline: ERROR_UNPOLLED is exactly what ERROR expands to in a build
+ * without LIBEX_POLL, so this is the loop a caller pays for with neither
+ * LIBEX_DEADLINE nor LIBEX_CANCEL defined */
+static exc_type check_unpolled(int n) {
+	THROWS(ETimedout)
+	int i;
+	for (i = 0; i < n; ++i) {
+		ERROR_UNPOLLED((exc_type)sink);
+	}
+	THROWONERROR_UNPOLLED;
+	DONE;
+}
+
+/* ERROR(E) is a single check point, so n of them cost n polls; an exception
+ * only breaks out of the loop, so it is rethrown after it */
+static exc_type check_loop(int n) {
+	THROWS(ETimedout)
+	int i;
+	for (i = 0; i < n; ++i) {
+		ERROR((exc_type)sink);
+	}
+	THROWONERROR;
+	DONE;
+}
+
+static exc_type check_deadline(int n) {
+	THROWS(ETimedout)
+	TRY_DEADLINE(3600000000000ULL, ) {
+		ERROR(check_loop(n));
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static void bench_deadline(void) {
+	uint64_t t0 = now_ns();
+	check_unpolled(CHECKS);
+	uint64_t t1 = now_ns();
+	check_loop(CHECKS);
+	uint64_t t2 = now_ns();
+	check_deadline(CHECKS);
+	uint64_t t3 = now_ns();
+	printf("deadline: unpolled %.2f ns/check, polled with no deadline %.2f ns/check, deadline installed %.2f ns/check\n",
+		(double)(t1 - t0) / CHECKS, (double)(t2 - t1) / CHECKS, (double)(t3 - t2) / CHECKS);
+}
+
+static exc_type check_cancelable(int n) {
+	THROWS(ECanceled)
+	ex_cancel_token tok = EX_CANCEL_TOKEN_INIT;
+	TRY_CANCELABLE(&tok, ) {
+		ERROR(check_loop(n));
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static void bench_cancel(void) {
+	uint64_t t0 = now_ns();
+	check_unpolled(CHECKS);
+	uint64_t t1 = now_ns();
+	check_cancelable(CHECKS);
+	uint64_t t2 = now_ns();
+	printf("cancel: unpolled %.2f ns/check, token installed %.2f ns/check\n",
+		(double)(t1 - t0) / CHECKS, (double)(t2 - t1) / CHECKS);
+}
+
+#define ELEMS (1 << 24)
+
+static double elems[ELEMS];
+
+static exc_type scale_chunk(void *ctx, size_t begin, size_t end) {
+	THROWS(EOverflow)
+	size_t i;
+	for (i = begin; i < end; ++i) {
+		elems[i] = elems[i] * 1.0001 + (double)i;
+	}
+	DONE;
+}
+
+static void bench_parallel_for(void) {
+	size_t threads;
+	for (threads = 1; threads <= 64; threads *= 2) {
+		ex_pool pool;
+		uint64_t t0;
+		if (ex_pool_init(&pool, threads) != ENoError) break;
+		/* warm up the pages and the threads */
+		ex_parallel_for(&pool, ELEMS, 4096, scale_chunk, NULL);
+		t0 = now_ns();
+		ex_parallel_for(&pool, ELEMS, 4096, scale_chunk, NULL);
+		printf("parallel_for: %2zu threads %.2f ms\n", threads, (double)(now_ns() - t0) / 1e6);
+		ex_pool_destroy(&pool);
+	}
+}
+
+#define OPS 10000000
+
+static int resources[5];
+
+/* acquisition fails for resource fail */
+static int *acquire(int i, int fail) {
+	return i == fail ? NULL : &resources[i];
+}
+
+static void release_resource(void *r) {
+	sink += *(int*)r;
+}
+
+/* the two variants each get a section of their own, whose bounds the linker
+ * defines, so their code size can be compared as well as their speed */
+extern const char __start_bench_nested[], __stop_bench_nested[];
+extern const char __start_bench_deferred[], __stop_bench_deferred[];
+
+static __attribute__((noinline, section("bench_nested"))) exc_type acquire_nested(int fail) {
+	THROWS(EOutOfMemory)
+	int *a = NULL, *b = NULL, *c = NULL, *d = NULL, *e = NULL;
+	TRY() {
+		MAYBE(a = acquire(0, fail), EOutOfMemory);
+	} IN {
+		TRY() {
+			MAYBE(b = acquire(1, fail), EOutOfMemory);
+		} IN {
+			TRY() {
+				MAYBE(c = acquire(2, fail), EOutOfMemory);
+			} IN {
+				TRY() {
+					MAYBE(d = acquire(3, fail), EOutOfMemory);
+				} IN {
+					TRY() {
+						MAYBE(e = acquire(4, fail), EOutOfMemory);
+					} IN {
+					} HANDLE CATCHANY {
+						RETHROW;
+					} FINALLY {
+						if (e) release_resource(e);
+					}
+				} HANDLE CATCHANY {
+					RETHROW;
+				} FINALLY {
+					release_resource(d);
+				}
+			} HANDLE CATCHANY {
+				RETHROW;
+			} FINALLY {
+				release_resource(c);
+			}
+		} HANDLE CATCHANY {
+			RETHROW;
+		} FINALLY {
+			release_resource(b);
+		}
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		release_resource(a);
+	}
+	DONE;
+}
+
+static __attribute__((noinline, section("bench_deferred"))) exc_type acquire_deferred(int fail) {
+	THROWS(EOutOfMemory)
+	TRY_DEFER(int *r) {
+		MAYBE(r = acquire(0, fail), EOutOfMemory);
+		DEFER(release_resource, r);
+		MAYBE(r = acquire(1, fail), EOutOfMemory);
+		DEFER(release_resource, r);
+		MAYBE(r = acquire(2, fail), EOutOfMemory);
+		DEFER(release_resource, r);
+		MAYBE(r = acquire(3, fail), EOutOfMemory);
+		DEFER(release_resource, r);
+		MAYBE(r = acquire(4, fail), EOutOfMemory);
+		DEFER(release_resource, r);
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static void bench_defer(void) {
+	int i, fail;
+	for (fail = 4; fail <= 5; ++fail) {
+		uint64_t t0 = now_ns(), t1, t2;
+		for (i = 0; i < OPS; ++i) acquire_nested(fail);
+		t1 = now_ns();
+		for (i = 0; i < OPS; ++i) acquire_deferred(fail);
+		t2 = now_ns();
+		printf("defer: %s path nested TRY %.2f ns, TRY_DEFER %.2f ns\n", fail == 5 ? "success" : "error",
+			(double)(t1 - t0) / OPS, (double)(t2 - t1) / OPS);
+	}
+	printf("defer: code size nested TRY %ld bytes, TRY_DEFER %ld bytes\n",
+		(long)(__stop_bench_nested - __start_bench_nested), (long)(__stop_bench_deferred - __start_bench_deferred));
+}
+
+#define EACH 512
+
+static volatile int slots[EACH];
+
+static exc_type take_slot(int i, int fail) {
+	if (i == fail) return EDescriptorTooBig;
+	slots[i] = 1;
+	return ENoError;
+}
+
+/* the hand-written form: a loop, a flag, and a count of what to release */
+static exc_type acquire_loop(int fail) {
+	THROWS(EDescriptorTooBig)
+	int acquired = 0;
+	TRY() {
+		for (acquired = 0; acquired < EACH; ++acquired) {
+			ERROR(take_slot(acquired, fail));
+		}
+		THROWONERROR;
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		while (acquired-- > 0) slots[acquired] = 0;
+	}
+	DONE;
+}
+
+static exc_type acquire_each(int fail) {
+	THROWS(EDescriptorTooBig)
+	TRY_EACH(i, EACH, take_slot(i, fail), slots[i] = 0, ) {
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static void bench_each(void) {
+	int i, fail;
+	for (fail = EACH / 2; fail <= EACH; fail += EACH / 2) {
+		uint64_t t0 = now_ns(), t1, t2;
+		for (i = 0; i < OPS / 100; ++i) acquire_loop(fail);
+		t1 = now_ns();
+		for (i = 0; i < OPS / 100; ++i) acquire_each(fail);
+		t2 = now_ns();
+		printf("each: %s path, %d resources: loop %.1f ns, TRY_EACH %.1f ns\n", fail == EACH ? "success" : "error",
+			EACH, (double)(t1 - t0) / (OPS / 100), (double)(t2 - t1) / (OPS / 100));
+	}
+}
+
+/* a request handler with three temporary buffers */
+static __attribute__((noinline)) exc_type scratch_malloc(void) {
+	THROWS(EOutOfMemory)
+	char *a = NULL, *b = NULL, *c = NULL;
+	TRY() {
+		MAYBE(a = (char*)malloc(64), EOutOfMemory);
+		MAYBE(b = (char*)malloc(256), EOutOfMemory);
+		MAYBE(c = (char*)malloc(1024), EOutOfMemory);
+	} IN {
+		a[0] = b[0] = c[0] = (char)sink;
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		free(c);
+		free(b);
+		free(a);
+	}
+	DONE;
+}
+
+static __attribute__((noinline)) exc_type scratch_group(void) {
+	THROWS(EOutOfMemory)
+	TRY_GROUP(char *a; char *b; char *c) {
+		GROUP_ALLOC(GROUP(a, 64) GROUP(b, 256) GROUP(c, 1024))
+	} IN {
+		a[0] = b[0] = c[0] = (char)sink;
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static __attribute__((noinline)) exc_type scratch_arena(ex_arena *arena) {
+	THROWS(EOutOfMemory)
+	TRY_ARENA(arena, char *a; char *b; char *c) {
+		ARENA_ALLOC(a, 64)
+		ARENA_ALLOC(b, 256)
+		ARENA_ALLOC(c, 1024)
+	} IN {
+		a[0] = b[0] = c[0] = (char)sink;
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static void bench_scratch(void) {
+	ex_arena arena;
+	uint64_t t0, t1, t2, t3;
+	int i;
+	if (ex_arena_init(&arena, 1 << 16) != ENoError) return;
+	t0 = now_ns();
+	for (i = 0; i < OPS; ++i) scratch_malloc();
+	t1 = now_ns();
+	for (i = 0; i < OPS; ++i) scratch_group();
+	t2 = now_ns();
+	for (i = 0; i < OPS; ++i) {
+		scratch_arena(&arena);
+		ex_arena_reset(&arena);
+	}
+	t3 = now_ns();
+	printf("scratch: 3 buffers per request, malloc/free %.2f ns, TRY_GROUP %.2f ns, TRY_ARENA %.2f ns\n",
+		(double)(t1 - t0) / OPS, (double)(t2 - t1) / OPS, (double)(t3 - t2) / OPS);
+	ex_arena_destroy(&arena);
+}
+
+/* request sizes skewed like a typical handler's: 9 in 10 under 1 KiB and the
+ * rest up to 16 KiB, from a fixed seed so every run sees the same sequence */
+#define SIZES 4096
+
+static size_t sizes[SIZES];
+
+static void fill_sizes(void) {
+	uint32_t x = 12345;
+	int i;
+	for (i = 0; i < SIZES; ++i) {
+		x = x * 1103515245 + 12345;
+		sizes[i] = (x >> 16) % 10 ? 16 + (x >> 8) % 1000 : 1024 + (x >> 4) % 15360;
+	}
+}
+
+static __attribute__((noinline)) exc_type sized_malloc(size_t n) {
+	THROWS(EOutOfMemory)
+	char *buf = NULL;
+	TRY() {
+		MAYBE(buf = (char*)malloc(n), EOutOfMemory);
+	} IN {
+		buf[0] = buf[n - 1] = (char)sink;
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		free(buf);
+	}
+	DONE;
+}
+
+static __attribute__((noinline)) exc_type sized_scratch(size_t n) {
+	THROWS(EOutOfMemory)
+	char *buf;
+	TRY_SCRATCH(buf, n, ) {
+	} IN {
+		buf[0] = buf[n - 1] = (char)sink;
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static void bench_small_buffer(void) {
+	uint64_t t0, t1, t2;
+	int i, heap = 0;
+	fill_sizes();
+	for (i = 0; i < SIZES; ++i) heap += sizes[i] > LIBEX_SCRATCH_SIZE;
+	t0 = now_ns();
+	for (i = 0; i < OPS; ++i) sized_malloc(sizes[i % SIZES]);
+	t1 = now_ns();
+	for (i = 0; i < OPS; ++i) sized_scratch(sizes[i % SIZES]);
+	t2 = now_ns();
+	printf("small_buffer: malloc calls per 1000 requests %d -> %d, malloc/free %.2f ns, TRY_SCRATCH %.2f ns\n",
+		1000, (int)((uint64_t)heap * 1000 / SIZES), (double)(t1 - t0) / OPS, (double)(t2 - t1) / OPS);
+}
+
+/* an in-memory index updated k words at a time, failing at the end when
+ * fail is set */
+#define INDEX_WORDS 512
+#define BIG_INDEX_WORDS 65536
+
+static uint64_t index_a[BIG_INDEX_WORDS], index_b[BIG_INDEX_WORDS];
+static uint64_t *index_live = index_a, *index_spare = index_b;
+static int index_words;
+
+static __attribute__((noinline)) exc_type update_txn(int k, int fail) {
+	THROWS(EOverflow, EOutOfMemory)
+	TRY_TXN() {
+		int i;
+		for (i = 0; i < k; ++i) {
+			TXN_WRITE(&index_live[(i * 37) % INDEX_WORDS], (uint64_t)sink + i);
+		}
+		THROWONERROR;
+		if (fail) THROW(EOverflow)
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+/* the alternative: update a copy, and swap it in on success */
+static __attribute__((noinline)) exc_type update_copy(int k, int fail) {
+	THROWS(EOverflow)
+	TRY() {
+		int i;
+		memcpy(index_spare, index_live, index_words * sizeof(uint64_t));
+		for (i = 0; i < k; ++i) {
+			index_spare[(i * 37) % INDEX_WORDS] = (uint64_t)sink + i;
+		}
+		if (fail) THROW(EOverflow)
+	} IN {
+		uint64_t *t = index_live;
+		index_live = index_spare;
+		index_spare = t;
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static void bench_txn(void) {
+	int k, fail, i;
+	for (index_words = INDEX_WORDS; index_words <= BIG_INDEX_WORDS; index_words *= BIG_INDEX_WORDS / INDEX_WORDS) {
+		int ops = OPS / 10 / (index_words / INDEX_WORDS);
+		for (k = 10; k <= 100; k *= 10) {
+			for (fail = 0; fail <= 1; ++fail) {
+				uint64_t t0 = now_ns(), t1, t2;
+				for (i = 0; i < ops; ++i) update_copy(k, fail);
+				t1 = now_ns();
+				for (i = 0; i < ops; ++i) update_txn(k, fail);
+				t2 = now_ns();
+				printf("txn: %d words of %d, %s path, copy-then-swap %.1f ns, TRY_TXN %.1f ns\n", k, index_words,
+					fail ? "error" : "success", (double)(t1 - t0) / ops, (double)(t2 - t1) / ops);
+			}
+		}
+	}
+	ex_txn_release();
+}
+
+/* committers append a record and wait for it to be durable, either with
+ * their own fdatasync or through a shared group commit, for COMMIT_NS; the
+ * file is created in the current directory, so run it on the filesystem to
+ * be measured */
+#define COMMIT_NS 500000000
+#define COMMITTERS 256
+
+typedef struct commit_ctx {
+	int fd;
+	ex_group_commit *gc;	/* NULL to sync individually */
+	atomic_int stop;
+	atomic_long commits;
+} commit_ctx;
+
+static void *commit_loop(void *arg) {
+	commit_ctx *c = (commit_ctx*)arg;
+	char rec[64];
+	memset(rec, 'r', sizeof(rec));
+	while (!atomic_load_explicit(&c->stop, memory_order_relaxed)) {
+		if (write(c->fd, rec, sizeof(rec)) != sizeof(rec)) break;
+		if ((c->gc != NULL ? ex_group_commit_sync(c->gc) : (fdatasync(c->fd) ? (exc_type)errno : ENoError)) != ENoError) break;
+		atomic_fetch_add_explicit(&c->commits, 1, memory_order_relaxed);
+	}
+	return NULL;
+}
+
+static double commit_rate(int fd, ex_group_commit *gc, int n) {
+	static pthread_t threads[COMMITTERS];
+	commit_ctx c;
+	uint64_t t0;
+	int i, started;
+	c.fd = fd;
+	c.gc = gc;
+	atomic_init(&c.stop, 0);
+	atomic_init(&c.commits, 0);
+	t0 = now_ns();
+	for (started = 0; started < n; ++started) {
+		if (pthread_create(&threads[started], NULL, commit_loop, &c)) break;
+	}
+	while (now_ns() - t0 < COMMIT_NS) {
+		struct timespec ts = { 0, 10000000 };
+		nanosleep(&ts, NULL);
+	}
+	atomic_store(&c.stop, 1);
+	for (i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+	return atomic_load(&c.commits) * 1e9 / (double)(now_ns() - t0);
+}
+
+static void bench_group_commit(void) {
+	char path[] = "group-commit.XXXXXX";
+	int fd = mkstemp(path), n;
+	ex_group_commit gc;
+	if (fd == -1) return;
+	unlink(path);
+	ex_group_commit_init(&gc, fd);
+	for (n = 1; n <= COMMITTERS; n *= 4) {
+		double own = commit_rate(fd, NULL, n);
+		double group = commit_rate(fd, &gc, n);
+		printf("group_commit: %3d committers, own fdatasync %.0f commits/s, group commit %.0f commits/s\n", n, own, group);
+	}
+	ex_group_commit_destroy(&gc);
+	close(fd);
+}
+
+/* move a TRANSFER_BYTES file, already in the page cache, into another file
+ * and into a pipe drained by a second thread, with the kernel paths and with
+ * read and write; the files are created in the current directory */
+#define TRANSFER_BYTES (64 << 20)
+#define TRANSFER_ROUNDS 8
+
+static void *drain_pipe(void *arg) {
+	static char buf[65536];
+	int fd = *(int*)arg;
+	while (read(fd, buf, sizeof(buf)) > 0) {
+	}
+	return NULL;
+}
+
+/* MB/s for TRANSFER_ROUNDS transfers of in to out, by one method: 0 for
+ * ex_transfer, 1 for ex_splice, 2 for the read/write fallback */
+static double transfer_rate(int in, int out, int method) {
+	ex_transfer_buf buf = EX_TRANSFER_BUF_INIT;
+	uint64_t t0 = now_ns();
+	int i;
+	for (i = 0; i < TRANSFER_ROUNDS; ++i) {
+		size_t done = 0;
+		exc_type e;
+		lseek(in, 0, SEEK_SET);
+		if (lseek(out, 0, SEEK_SET) == 0) ftruncate(out, 0);
+		e = method == 0 ? ex_transfer(in, out, TRANSFER_BYTES, &done, &buf)
+			: method == 1 ? ex_splice(in, out, TRANSFER_BYTES, &done)
+			: ex_transfer_copy(in, out, TRANSFER_BYTES, &done, &buf);
+		if (e != ENoError || done != TRANSFER_BYTES) return 0;
+	}
+	ex_transfer_buf_free(&buf);
+	return (double)TRANSFER_BYTES * TRANSFER_ROUNDS / 1e6 / ((now_ns() - t0) / 1e9);
+}
+
+static void bench_transfer(void) {
+	char src[] = "transfer-src.XXXXXX", dst[] = "transfer-dst.XXXXXX";
+	int in = mkstemp(src), out = mkstemp(dst), p[2];
+	static char block[1 << 20];
+	pthread_t reader;
+	size_t i;
+	if (in == -1 || out == -1) return;
+	unlink(src);
+	unlink(dst);
+	memset(block, 'x', sizeof(block));
+	for (i = 0; i < TRANSFER_BYTES / sizeof(block); ++i) {
+		if (write(in, block, sizeof(block)) != sizeof(block)) return;
+	}
+	transfer_rate(in, out, 2);
+	printf("transfer: file to file, copy_file_range %.0f MB/s, read/write %.0f MB/s\n",
+		transfer_rate(in, out, 0), transfer_rate(in, out, 2));
+	if (pipe(p) == 0 && pthread_create(&reader, NULL, drain_pipe, &p[0]) == 0) {
+		printf("transfer: file to pipe, sendfile %.0f MB/s, splice %.0f MB/s, read/write %.0f MB/s\n",
+			transfer_rate(in, p[1], 0), transfer_rate(in, p[1], 1), transfer_rate(in, p[1], 2));
+		close(p[1]);
+		pthread_join(reader, NULL);
+		close(p[0]);
+	}
+	close(in);
+	close(out);
+}
+
+/* a kernel dividing DIVIDE elements pairwise, either checking every divisor
+ * or relying on TRY_GUARDED to turn a zero divisor into EOutOfRange */
+#define DIVIDE 4096
+
+static exc_type divide_checked(const int *a, const int *b, int *out) {
+	THROWS(EOutOfRange)
+	int i;
+	for (i = 0; i < DIVIDE; ++i) {
+		if (b[i] == 0 || (b[i] == -1 && a[i] == INT32_MIN)) THROW(EOutOfRange)
+		out[i] = a[i] / b[i];
+	}
+	THROWONERROR;
+	DONE;
+}
+
+static exc_type divide_guarded(const int *a, const int *b, int *out) {
+	THROWS(EOutOfRange)
+	int i;
+	TRY_GUARDED(NULL, 0, ) {
+	} IN {
+		for (i = 0; i < DIVIDE; ++i) out[i] = a[i] / b[i];
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static exc_type divide_one_guarded(int a, int b, int *out) {
+	THROWS(EOutOfRange)
+	TRY_GUARDED(NULL, 0, ) {
+	} IN {
+		*out = a / b;
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static void bench_guarded(void) {
+	static int a[DIVIDE], b[DIVIDE], out[DIVIDE];
+	int i, rounds = OPS / DIVIDE;
+	uint64_t t0, t1, t2, t3;
+	for (i = 0; i < DIVIDE; ++i) {
+		a[i] = rand() - RAND_MAX / 2;
+		b[i] = rand() % 1000 + 1;
+	}
+	t0 = now_ns();
+	for (i = 0; i < rounds; ++i) sink += divide_checked(a, b, out) + out[i % DIVIDE];
+	t1 = now_ns();
+	for (i = 0; i < rounds; ++i) sink += divide_guarded(a, b, out) + out[i % DIVIDE];
+	t2 = now_ns();
+	for (i = 0; i < OPS; ++i) sink += divide_one_guarded(a[i % DIVIDE], b[i % DIVIDE], out);
+	t3 = now_ns();
+	printf("guarded: %d divisions, checked %.2f ns, guarded %.2f ns per division; one division per block %.1f ns\n",
+		DIVIDE, (double)(t1 - t0) / rounds / DIVIDE, (double)(t2 - t1) / rounds / DIVIDE, (double)(t3 - t2) / OPS);
+}
+
+/* requests that each write WRITES small pieces of output to /dev/null, with
+ * a write() per piece or through TRY_WRITER; system calls are counted from
+ * /proc/self/io */
+#define REQUESTS 200000
+#define WRITES 20
+
+static long write_syscalls(void) {
+	char line[64];
+	long n = -1;
+	FILE *f = fopen("/proc/self/io", "r");
+	if (f == NULL) return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "syscw: %ld", &n) == 1) break;
+	}
+	fclose(f);
+	return n;
+}
+
+static exc_type respond_direct(int fd, const char *piece, size_t len) {
+	THROWS(EIOError)
+	int i;
+	for (i = 0; i < WRITES; ++i) {
+		ERRORE(write(fd, piece, len) != (ssize_t)len, errno);
+	}
+	THROWONERROR;
+	DONE;
+}
+
+static exc_type respond_buffered(int fd, const char *piece, size_t len) {
+	THROWS(EIOError)
+	ex_writer w;
+	int i;
+	TRY_WRITER(w, fd, ) {
+	} IN {
+		for (i = 0; i < WRITES; ++i) {
+			ERROR(ex_write(&w, piece, len));
+		}
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static void bench_writer(void) {
+	static const char piece[] = "2026-10-16T12:00:00Z GET /index.html 200 4096\n";
+	int fd = open("/dev/null", O_WRONLY), i;
+	long c0, c1, c2;
+	uint64_t t0, t1, t2;
+	if (fd == -1) return;
+	c0 = write_syscalls();
+	t0 = now_ns();
+	for (i = 0; i < REQUESTS; ++i) sink += respond_direct(fd, piece, sizeof(piece) - 1);
+	t1 = now_ns();
+	c1 = write_syscalls();
+	for (i = 0; i < REQUESTS; ++i) sink += respond_buffered(fd, piece, sizeof(piece) - 1);
+	t2 = now_ns();
+	c2 = write_syscalls();
+	printf("writer: %d writes per request, write() %.1f syscalls %.0f ns, TRY_WRITER %.1f syscalls %.0f ns per request\n",
+		WRITES, (double)(c1 - c0) / REQUESTS, (double)(t1 - t0) / REQUESTS,
+		(double)(c2 - c1) / REQUESTS, (double)(t2 - t1) / REQUESTS);
+	close(fd);
+}
+
+/* bounce BATCH 64-byte datagrams over loopback, one system call per message
+ * with sendto and recv, or one per batch with ex_sendmmsg and ex_recvmmsg */
+#define BATCH 32
+#define DATAGRAMS 2000000
+
+static void bench_batch(void) {
+	int tx = socket(AF_INET, SOCK_DGRAM, 0), rx = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in to;
+	socklen_t len = sizeof(to);
+	static struct mmsghdr out[BATCH], in[BATCH];
+	static struct iovec oiov[BATCH], iiov[BATCH];
+	static char payload[64], bufs[BATCH][64];
+	ex_batch batch;
+	uint64_t t0, t1, t2;
+	long lost = 0;
+	int i, j;
+	if (tx == -1 || rx == -1) return;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(rx, (struct sockaddr*)&to, sizeof(to)) || getsockname(rx, (struct sockaddr*)&to, &len)) return;
+	for (j = 0; j < BATCH; ++j) {
+		oiov[j].iov_base = payload;
+		oiov[j].iov_len = sizeof(payload);
+		out[j].msg_hdr.msg_name = &to;
+		out[j].msg_hdr.msg_namelen = sizeof(to);
+		out[j].msg_hdr.msg_iov = &oiov[j];
+		out[j].msg_hdr.msg_iovlen = 1;
+		iiov[j].iov_base = bufs[j];
+		iiov[j].iov_len = sizeof(bufs[j]);
+		in[j].msg_hdr.msg_iov = &iiov[j];
+		in[j].msg_hdr.msg_iovlen = 1;
+	}
+	t0 = now_ns();
+	for (i = 0; i < DATAGRAMS / BATCH; ++i) {
+		for (j = 0; j < BATCH; ++j) {
+			if (sendto(tx, payload, sizeof(payload), 0, (struct sockaddr*)&to, sizeof(to)) < 0) ++lost;
+		}
+		for (j = 0; j < BATCH; ++j) {
+			if (recv(rx, bufs[j], sizeof(bufs[j]), MSG_DONTWAIT) < 0) ++lost;
+		}
+	}
+	t1 = now_ns();
+	for (i = 0; i < DATAGRAMS / BATCH; ++i) {
+		if (ex_sendmmsg(tx, out, BATCH, 0, &batch) != ENoError || batch.failed != 0) ++lost;
+		if (ex_recvmmsg(rx, in, BATCH, MSG_DONTWAIT, &batch) != ENoError || batch.count != BATCH || batch.failed != 0) ++lost;
+	}
+	t2 = now_ns();
+	printf("batch: %d datagrams per batch, per message %.0f ns, batched %.0f ns per datagram (%ld failures)\n",
+		BATCH, (double)(t1 - t0) / DATAGRAMS, (double)(t2 - t1) / DATAGRAMS, lost);
+	close(tx);
+	close(rx);
+}
+
+/* the server and load generator of echo.c, without disconnects, over a
+ * growing number of connections */
+#define ECHO_CLIENTS 64
+
+static void bench_echo(void) {
+	int n;
+	for (n = 1; n <= ECHO_CLIENTS; n *= 4) {
+		if (echo_load(n, 1, 0) != 0) return;
+	}
+}
+
+/* a tree of WALK_DIRS directories of WALK_DIRS subdirectories, each with
+ * WALK_FILES files, walked by nftw, ex_walk and ex_walk_parallel */
+#define WALK_DIRS 32
+#define WALK_FILES 48
+#define WALK_ROUNDS 3
+
+static atomic_long walk_entries;
+
+static int walk_nftw_count(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	atomic_fetch_add_explicit(&walk_entries, 1, memory_order_relaxed);
+	return 0;
+}
+
+static int walk_nftw_remove(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	return remove(path);
+}
+
+static exc_type walk_count(void *ctx, const ex_walk_entry *e) {
+	atomic_fetch_add_explicit(&walk_entries, 1, memory_order_relaxed);
+	return ENoError;
+}
+
+/* the best of WALK_ROUNDS walks, in entries per second */
+static double walk_rate(const char *root, int method, ex_pool *pool) {
+	double best = 0;
+	int i;
+	for (i = 0; i < WALK_ROUNDS; ++i) {
+		uint64_t t0 = now_ns();
+		double rate;
+		exc_type e = ENoError;
+		atomic_store(&walk_entries, 0);
+		if (method == 0) {
+			if (nftw(root, walk_nftw_count, 64, FTW_PHYS) != 0) return 0;
+		} else if (method == 1) {
+			e = ex_walk(root, walk_count, NULL, NULL);
+		} else {
+			e = ex_walk_parallel(pool, root, walk_count, NULL, NULL);
+		}
+		if (e != ENoError) return 0;
+		rate = atomic_load(&walk_entries) * 1e9 / (double)(now_ns() - t0);
+		if (rate > best) best = rate;
+	}
+	return best;
+}
+
+static void bench_walk(void) {
+	char root[] = "walk-tree.XXXXXX", path[64];
+	ex_pool pool;
+	int i, j, k;
+	if (mkdtemp(root) == NULL) return;
+	for (i = 0; i < WALK_DIRS; ++i) {
+		for (j = 0; j < WALK_DIRS; ++j) {
+			snprintf(path, sizeof(path), "%s/%d", root, i);
+			mkdir(path, 0755);
+			snprintf(path, sizeof(path), "%s/%d/%d", root, i, j);
+			if (mkdir(path, 0755) != 0) return;
+			for (k = 0; k < WALK_FILES; ++k) {
+				snprintf(path, sizeof(path), "%s/%d/%d/%d", root, i, j, k);
+				close(open(path, O_WRONLY | O_CREAT, 0644));
+			}
+		}
+	}
+	if (ex_pool_init(&pool, 4) == ENoError) {
+		walk_rate(root, 0, &pool);
+		printf("walk: %d entries, nftw %.1f M/s, ex_walk %.1f M/s, ex_walk_parallel on 4 threads %.1f M/s\n",
+			WALK_DIRS * (1 + WALK_DIRS * (1 + WALK_FILES)), walk_rate(root, 0, &pool) / 1e6,
+			walk_rate(root, 1, &pool) / 1e6, walk_rate(root, 2, &pool) / 1e6);
+		ex_pool_destroy(&pool);
+	}
+	nftw(root, walk_nftw_remove, 64, FTW_PHYS | FTW_DEPTH);
+}
+
+/* launch /bin/true SPAWNS times with fork and execve, posix_spawn and
+ * ex_spawn, with more and more of the heap touched */
+#define SPAWNS 200
+
+static double spawn_cost(int method) {
+	char *argv[] = { "/bin/true", NULL };
+	uint64_t t0 = now_ns();
+	int i, status;
+	for (i = 0; i < SPAWNS; ++i) {
+		pid_t pid;
+		if (method == 0) {
+			if ((pid = fork()) == 0) {
+				execve(argv[0], argv, environ);
+				_exit(127);
+			}
+			if (pid < 0 || waitpid(pid, &status, 0) != pid) return 0;
+		} else if (method == 1) {
+			if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0 || waitpid(pid, &status, 0) != pid) return 0;
+		} else {
+			ex_child child;
+			if (ex_spawn(&child, argv[0], argv, NULL, NULL) != ENoError || ex_child_wait(&child) != ENoError) return 0;
+		}
+	}
+	return (now_ns() - t0) / 1e3 / SPAWNS;
+}
+
+static void bench_spawn(void) {
+	size_t mb;
+	for (mb = 0; mb <= 1024; mb = mb ? mb * 4 : 64) {
+		char *heap = mb ? (char*)malloc(mb << 20) : NULL;
+		if (mb && heap == NULL) return;
+		if (heap) memset(heap, 1, mb << 20);
+		printf("spawn: %4zu MB touched, fork+execve %.0f us, posix_spawn %.0f us, ex_spawn %.0f us\n",
+			mb, spawn_cost(0), spawn_cost(1), spawn_cost(2));
+		free(heap);
+	}
+}
+
+static const struct bench {
+	const char *name;
+	void (*run)(void);
+} benches[] = {
+	{ "deadline", bench_deadline },
+	{ "cancel", bench_cancel },
+	{ "parallel_for", bench_parallel_for },
+	{ "defer", bench_defer },
+	{ "each", bench_each },
+	{ "scratch", bench_scratch },
+	{ "small_buffer", bench_small_buffer },
+	{ "txn", bench_txn },
+	{ "group_commit", bench_group_commit },
+	{ "transfer", bench_transfer },
+	{ "guarded", bench_guarded },
+	{ "writer", bench_writer },
+	{ "batch", bench_batch },
+	{ "echo", bench_echo },
+	{ "walk", bench_walk },
+	{ "spawn", bench_spawn },
+};
+
+int main(int argc, char **argv) {
+	size_t i;
+	int j;
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+		for (j = 1; j < argc && strcmp(argv[j], benches[i].name); ++j);
+		if (argc == 1 || j < argc) benches[i].run();
+	}
+	return 0;
+}
@@ -0,0 +1,402 @@
+/*
+ * A loopback echo server and load generator built on libex, for measuring
+ * the exception machinery under a realistic load rather than in a loop.
+ *
+ * The server accepts on one ex_loop thread, and echoes REQUEST byte messages
+ * with a TRY block per step of each connection, which handles peers that
+ * reset (EConnectionReset) or vanish mid-reply (EBrokenPipe). A connection
+ * outlives the TRY blocks of its steps, which end whenever it would block,
+ * so the watch's close function releases it, and the FINALLY of accept_one
+ * only releases one that never reached the loop. A connection the server
+ * can not take on, for want of descriptors or memory, is dropped, and the
+ * listener keeps accepting.
+ *
+ * The load generator keeps a number of connections busy with request/reply
+ * round trips on a second loop, and aborts a connection with a reset after
+ * the given share of requests, replacing it with a new one. At the end it
+ * reports round trips per second, the median and 99th percentile latency,
+ * and what the server caught.
+ *
+ * Build once per mode, with optimisations:
+ *
+ *   cc -O2 -pthread echo.c -o echo                                    release
+ *   cc -O2 -pthread -D_DEBUG echo.c -o echo                           _DEBUG
+ *   cc -O2 -pthread -DLIBEX_DEADLINE -DLIBEX_CANCEL echo.c -o echo    instrumented
+ *
+ * where instrumented polls the deadline and cancellation sources at every
+ * check point. Then run
+ *
+ *   ./echo [connections [seconds [disconnects per 1000 requests]]]
+ *
+ * which defaults to 64 connections for 5 seconds, with 1 disconnect per 1000.
+ * bench.c includes this file with ECHO_NO_MAIN defined, and runs the same
+ * server and load through echo_load.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include "libex.h"
+#include "libex_loop.h"
+
+#define REQUEST 64
+#define LATENCY_US 100000	/* latencies above this share the last bucket */
+
+#if defined(_DEBUG)
+#define MODE "_DEBUG"
+#elif defined(LIBEX_POLL)
+#define MODE "instrumented"
+#else
+#define MODE "release"
+#endif
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* the server */
+
+typedef struct server_conn {
+	ex_watch watch;
+	char buf[REQUEST];
+	size_t done;		/* bytes of the current message read or echoed */
+	int replying;
+} server_conn;
+
+static long accepted, dropped, resets, broken_pipes, other_errors;
+
+/* echo messages until the peer closes, raising EWouldBlock when stuck */
+static exc_type serve_some(int fd, server_conn *c) {
+	THROWS(EWouldBlock, EConnectionReset, EBrokenPipe)
+	for (;;) {
+		ssize_t n = c->replying ? send(fd, c->buf + c->done, REQUEST - c->done, MSG_NOSIGNAL)
+			: recv(fd, c->buf + c->done, REQUEST - c->done, 0);
+		ERRORE(n < 0, errno);
+		if (n == 0) RETURN;
+		if ((c->done += n) == REQUEST) {
+			c->done = 0;
+			c->replying = !c->replying;
+		}
+	}
+	THROWONERROR;
+	DONE;
+}
+
+static exc_type serve(ex_loop *loop, ex_watch *w) {
+	THROWS(EWouldBlock)
+	server_conn *c = (server_conn*)w->data;
+	TRY() {
+		ERROR(serve_some(w->fd, c));
+	} IN {
+	} HANDLE CATCH(EWouldBlock) {
+		WAIT_READY(w, c->replying ? EX_WRITABLE : EX_READABLE);
+	} CATCH(EConnectionReset) {
+		/* the client aborted; this completes the connection normally */
+		++resets;
+	} CATCH(EBrokenPipe) {
+		++broken_pipes;
+	} CATCHANY {
+		++other_errors;
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+/* the watch's close function, which the loop calls exactly once when the
+ * connection completes; a connection outlives every TRY block of its steps,
+ * which end whenever it would block, so this is where it is released */
+static void hang_up(ex_loop *loop, ex_watch *w, exc_type e) {
+	close(w->fd);
+	free(w->data);
+}
+
+/* accept one connection and start serving it; whatever fails, the
+ * connection is dropped rather than the listener */
+static exc_type accept_one(ex_loop *loop, int listener) {
+	THROWS(EWouldBlock, EOutOfMemory, EDescriptorTooBig, ETooManyOpenFiles, ...)
+	server_conn *c = NULL;
+	int fd = -1;
+	TRY() {
+		ERRORE(-1 == (fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)), errno);
+		MAYBE(c = (server_conn*)calloc(1, sizeof(*c)), EOutOfMemory)
+		ex_watch_init(&c->watch, fd, serve, hang_up, c);
+		ERROR_UNPOLLED(ex_loop_add(loop, &c->watch));
+		/* the loop owns the connection from here, and hangs it up */
+		c = NULL;
+		fd = -1;
+	} IN {
+		++accepted;
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		free(c);
+		if (fd != -1) close(fd);
+	}
+	DONE;
+}
+
+/* a descriptor held in reserve, so that a pending connection can still be
+ * accepted, and dropped, once the process has run out of them */
+static int spare = -1;
+
+/* drop the oldest pending connection, raising EWouldBlock if even that is
+ * impossible, so the listener waits for the next one instead of spinning */
+static exc_type drop_pending(ex_watch *w) {
+	THROWS(EWouldBlock)
+	int fd;
+	if (spare != -1) close(spare);
+	fd = accept4(w->fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd != -1) close(fd);
+	spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		ex_watch_wait(w, EX_READABLE);
+		THROW(EWouldBlock)
+	}
+	++dropped;
+	DONE;
+}
+
+/* accept until nothing is pending; an error only costs the connection it
+ * happened to, and the listener backs off while the system is short of
+ * memory, so it never stops accepting for good */
+static exc_type accept_all(ex_loop *loop, ex_watch *w) {
+	THROWS(EWouldBlock)
+	for (;;) {
+		TRY() {
+			ERROR(accept_one(loop, w->fd));
+		} IN {
+		} HANDLE CATCH(EWouldBlock) {
+			RETHROW;
+		} CATCH(EDescriptorTooBig) {
+			ERROR(drop_pending(w));
+		} CATCH(ETooManyOpenFiles) {
+			ERROR(drop_pending(w));
+		} CATCH(EOutOfMemory) {
+			ex_watch_wait(w, EX_READABLE);
+			THROW(EWouldBlock)
+		} CATCH(EBufferUnavailable) {
+			ex_watch_wait(w, EX_READABLE);
+			THROW(EWouldBlock)
+		} CATCHANY {
+			/* aborted before it was accepted, refused by a filter, ... */
+			++other_errors;
+		} FINALLY {
+		}
+		ENDTRY;
+	}
+	THROWONERROR;
+	DONE;
+}
+
+/* readable once the run is over */
+static exc_type stop_server(ex_loop *loop, ex_watch *w) {
+	ex_loop_stop(loop);
+	return EWouldBlock;
+}
+
+static void keep(ex_loop *loop, ex_watch *w, exc_type e) {
+}
+
+static void *run_server(void *arg) {
+	ex_loop_run((ex_loop*)arg);
+	return NULL;
+}
+
+/* the load generator */
+
+typedef struct client_conn {
+	ex_watch watch;
+	char buf[REQUEST];
+	size_t done;		/* bytes of the current message sent or read */
+	int replying;		/* waiting for the echo */
+	int aborting;		/* reset the connection once the request is sent */
+	uint64_t start;
+} client_conn;
+
+static struct sockaddr_in server_addr;
+static uint64_t until;
+static unsigned disconnect_per_mille;
+static uint64_t rng = 88172645463325252u;
+static long trips, aborts, client_errors, latency[LATENCY_US + 1];
+
+static unsigned next_random(void) {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned)rng;
+}
+
+static exc_type client_step(ex_loop *loop, ex_watch *w);
+static void client_done(ex_loop *loop, ex_watch *w, exc_type e);
+
+static exc_type connect_client(ex_loop *loop) {
+	THROWS(EOutOfMemory)
+	client_conn *c = NULL;
+	int fd = -1;
+	TRY() {
+		MAYBE(c = (client_conn*)calloc(1, sizeof(*c)), EOutOfMemory)
+		ERRORE(-1 == (fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)), errno);
+		ERRORE(0 != connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)), errno);
+		ERRORE(0 != fcntl(fd, F_SETFL, O_NONBLOCK), errno);
+		ex_watch_init(&c->watch, fd, client_step, client_done, c);
+		ERROR_UNPOLLED(ex_loop_add(loop, &c->watch));
+		/* the loop owns the connection from here, and client_done ends it */
+		c = NULL;
+		fd = -1;
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		if (fd != -1) close(fd);
+		free(c);
+	}
+	DONE;
+}
+
+/* run round trips until the time is up, or this one is to be aborted */
+static exc_type client_some(int fd, client_conn *c) {
+	THROWS(EWouldBlock, EConnectionReset)
+	for (;;) {
+		ssize_t n;
+		if (!c->replying && c->done == 0) {
+			c->start = now_ns();
+			c->aborting = next_random() % 1000 < disconnect_per_mille;
+		}
+		n = c->replying ? recv(fd, c->buf + c->done, REQUEST - c->done, 0)
+			: send(fd, c->buf + c->done, REQUEST - c->done, MSG_NOSIGNAL);
+		ERRORE(n < 0, errno);
+		ERRORE(n == 0, EConnectionReset);
+		if ((c->done += n) < REQUEST) continue;
+		c->done = 0;
+		if (!c->replying) {
+			if (c->aborting) RETURN;
+			c->replying = 1;
+		} else {
+			uint64_t us = (now_ns() - c->start) / 1000;
+			++latency[us < LATENCY_US ? us : LATENCY_US];
+			++trips;
+			c->replying = 0;
+			if (now_ns() > until) RETURN;
+		}
+	}
+	THROWONERROR;
+	DONE;
+}
+
+static exc_type client_step(ex_loop *loop, ex_watch *w) {
+	THROWS(EWouldBlock)
+	client_conn *c = (client_conn*)w->data;
+	TRY() {
+		ERROR(client_some(w->fd, c));
+	} IN {
+	} HANDLE CATCH(EWouldBlock) {
+		WAIT_READY(w, c->replying ? EX_READABLE : EX_WRITABLE);
+	} CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+/* close a finished connection, with a reset if it is being aborted, and
+ * replace it while the run lasts */
+static void client_done(ex_loop *loop, ex_watch *w, exc_type e) {
+	client_conn *c = (client_conn*)w->data;
+	if (c->aborting) {
+		struct linger hard = { 1, 0 };
+		setsockopt(w->fd, SOL_SOCKET, SO_LINGER, &hard, sizeof(hard));
+		++aborts;
+	}
+	close(w->fd);
+	if (e != ENoError) ++client_errors;
+	if (e == ENoError && c->aborting && now_ns() <= until) {
+		if (connect_client(loop) != ENoError) ++client_errors;
+	}
+	free(c);
+}
+
+static long latency_percentile(double p) {
+	long want = (long)(trips * p), seen = 0, us;
+	for (us = 0; us < LATENCY_US; ++us) {
+		if ((seen += latency[us]) > want) break;
+	}
+	return us;
+}
+
+/* serve connections clients for seconds, aborting per_mille of their
+ * requests, and print what happened */
+static int echo_load(int connections, int seconds, unsigned per_mille) {
+	int listener, stop[2], i;
+	ex_loop server, clients;
+	ex_watch accepting, stopping;
+	socklen_t len = sizeof(server_addr);
+	pthread_t thread;
+	uint64_t t0, t1;
+	disconnect_per_mille = per_mille;
+	accepted = dropped = resets = broken_pipes = other_errors = 0;
+	trips = aborts = client_errors = 0;
+	memset(latency, 0, sizeof(latency));
+	spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (listener == -1 || bind(listener, (struct sockaddr*)&server_addr, sizeof(server_addr))
+	 || listen(listener, 4096) || getsockname(listener, (struct sockaddr*)&server_addr, &len)
+	 || pipe2(stop, O_NONBLOCK | O_CLOEXEC)) {
+		perror("echo: listen");
+		return 1;
+	}
+	if (ex_loop_init(&server) != ENoError || ex_loop_init(&clients) != ENoError) {
+		perror("echo: epoll");
+		return 1;
+	}
+	ex_watch_init(&accepting, listener, accept_all, keep, NULL);
+	ex_watch_init(&stopping, stop[0], stop_server, keep, NULL);
+	if (ex_loop_add(&server, &accepting) != ENoError || ex_loop_add(&server, &stopping) != ENoError
+	 || pthread_create(&thread, NULL, run_server, &server)) {
+		perror("echo: server");
+		return 1;
+	}
+	t0 = now_ns();
+	until = t0 + (uint64_t)seconds * 1000000000u;
+	for (i = 0; i < connections; ++i) {
+		if (connect_client(&clients) != ENoError) {
+			perror("echo: connect");
+			return 1;
+		}
+	}
+	ex_loop_run(&clients);
+	t1 = now_ns();
+	/* let the server see the last hang-ups before stopping it */
+	usleep(100000);
+	if (write(stop[1], "x", 1) != 1) return 1;
+	pthread_join(thread, NULL);
+	printf("echo %s: %d connections, %u disconnects per 1000 requests: %.0f requests/s, p50 %ld us, p99 %ld us\n",
+		MODE, connections, disconnect_per_mille, trips * 1e9 / (double)(t1 - t0),
+		latency_percentile(0.5), latency_percentile(0.99));
+	printf("echo %s: clients aborted %ld, failed %ld; server accepted %ld, dropped %ld, caught %ld resets, %ld broken pipes, %ld other errors\n",
+		MODE, aborts, client_errors, accepted, dropped, resets, broken_pipes, other_errors);
+	ex_loop_destroy(&server);
+	ex_loop_destroy(&clients);
+	close(listener);
+	close(stop[0]);
+	close(stop[1]);
+	close(spare);
+	return 0;
+}
+
+#ifndef ECHO_NO_MAIN
+int main(int argc, char **argv) {
+	return echo_load(argc > 1 ? atoi(argv[1]) : 64, argc > 2 ? atoi(argv[2]) : 5,
+		argc > 3 ? (unsigned)atoi(argv[3]) : 1);
+}
+#endif
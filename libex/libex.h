@@ -41,9 +41,6 @@
  *   clients will get compile-time errors about duplicate cases. If they don't have the same
  *   value, we cannot distinguish between the cases. This only matters if errno could ever
  *   possibly take on either value after a single function call.
- * # Optionally intercept and handle signals? ie. catch div-by-zero and set errno. Register the
- *   signal handler at init time, and just use the ERROR() macro. Need some way to portably
- *   advance the ip in the event of error.
  * # Better integration with C libs. There are 4 general cases, 2 specific:
  *   1. expression returns error code directly.        => TRY (E_exc_type) => switch(E_exc_type) ...
  *   2. expression returns success/fail == 0/-1 or !0. => ENSURE (E_int)   => switch(E_int == 0 ? ENoError : errno) ...
@@ -63,9 +60,14 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <limits.h>
 #include <errno.h>
 
+#if defined(LIBEX_DEADLINE) || defined(LIBEX_CANCEL)
+#define LIBEX_POLL
+#endif
+
 /*
  * Define meaningful names for all exception types based on standard POSIX:
  * http://www.opengroup.org/onlinepubs/9699919799/basedefs/errno.h.html
@@ -203,7 +205,17 @@ typedef enum exc_type {
 #define RETHROW break
 #define EXC_CASE(E) THROWS = ENoError; break; E:
 #define __CUR_EXC__ THROWS
+#ifdef LIBEX_POLL
+/* with asynchronous exception sources enabled, every check point also polls
+ * them; the poll only runs when no exception is already in flight, and a
+ * source that raises stays quiet until the block that installed it exits */
+#define THROWONERROR if (THROWS != ENoError || ENoError != (THROWS = ex_poll())) RETHROW
+/* CANCELPOINT polls them explicitly, eg. in tight loops without check points */
+#define CANCELPOINT { exc_type __ex_polled = ex_poll(); if (__ex_polled != ENoError) THROW(__ex_polled) }
+#else
 #define THROWONERROR if (THROWS != ENoError) RETHROW
+#define CANCELPOINT
+#endif
 /* rethrows unhandled errors so code after the FINALLY block does not execute */
 #define ENDTRY THROWONERROR
 
@@ -216,13 +228,22 @@ typedef enum exc_type {
 #define FINALLY THROWS = ENoError; break; } } while(0); }
 
 /* MAYBE raises the exception R if E evaluates to NULL */
-#define MAYBE(E, R) if (NULL == (E)) THROW(R)
+#define MAYBE(E, R) if (NULL == (E)) THROW(R) CANCELPOINT
 
 /* ERROR raises the exception E if E evaluates to something other than ENoError */
 #define ERROR(E) THROWS = (E); THROWONERROR
 
 /* ERRORE raises the exception R if E evaluates to non-zero */
-#define ERRORE(E, R) if ((E)) THROW(R)
+#define ERRORE(E, R) if ((E)) THROW(R) CANCELPOINT
+
+/* THROWONERROR_UNPOLLED, ERROR_UNPOLLED, MAYBE_UNPOLLED and ERRORE_UNPOLLED
+ * are the same checks without polling, for the success checks that follow
+ * acquiring a resource, up to the point where something owns it and will
+ * release it; a poll there would raise with the resource held by nothing */
+#define THROWONERROR_UNPOLLED if (THROWS != ENoError) RETHROW
+#define ERROR_UNPOLLED(E) THROWS = (E); THROWONERROR_UNPOLLED
+#define MAYBE_UNPOLLED(E, R) if (NULL == (E)) THROW(R)
+#define ERRORE_UNPOLLED(E, R) if ((E)) THROW(R)
 
 /* set errno to 0, eval the expression, then check errno */
 #define CHECK(E) errno = 0; (E); ERROR(errno)
@@ -234,7 +255,8 @@ typedef enum exc_type {
 
 #ifdef _DEBUG
 
-#define TRY(D) { THROWONERROR; do { { D; do
+#define __TRY_OPEN(D) do { { D;
+#define TRY(D) { THROWONERROR; __TRY_OPEN(D) do
 #define IN while(0); if (THROWS == ENoError)
 #define HANDLE } switch(THROWS) { case ENoError: case EEarlyReturn: break;
 /* optionally deprecate HANDLE by requiring CATCHANY after IN */
@@ -247,7 +269,8 @@ typedef enum exc_type {
  * unlike DEBUG mode, all CATCH clauses can see the bindings introduced in
  * the TRY block. */
 
-#define TRY(D) { THROWONERROR; { D; do 
+#define __TRY_OPEN(D) { D;
+#define TRY(D) { THROWONERROR; __TRY_OPEN(D) do 
 #define IN while (0); switch (THROWS) { case ENoError: 
 #define HANDLE break; case EEarlyReturn: break;
 /* optionally deprecate HANDLE by requiring CATCHANY after IN */
@@ -255,4 +278,257 @@ typedef enum exc_type {
 
 #endif /*_DEBUG*/
 
+/* TRY_WITH(S, ENTER, LEAVE, D) is the building block for binding forms that
+ * own some resource for the lifetime of an exception block, and is used
+ * exactly like TRY(D). S declares the hidden state of the form, ENTER runs
+ * before the TRY scope and may raise by assigning THROWS, in which case the
+ * TRY scope is skipped and the handlers see the exception. LEAVE runs once
+ * the handlers are done, on every exit path, just before the FINALLY body; it
+ * sees the exception propagating out of the block in THROWS and may raise a
+ * new one by assigning it. ENTER and LEAVE must not THROW.
+ *
+ * The two nested loops only exist to run LEAVE after the block without an
+ * extra terminator, and are folded away by the compiler. */
+#define TRY_WITH(S, ENTER, LEAVE, D) THROWONERROR; else \
+	for (int __ex_pass = 0; __ex_pass < 2; ) \
+	for (S; __ex_pass < 2; ++__ex_pass) \
+	if (__ex_pass) { LEAVE; } else { ENTER; __TRY_OPEN(D) if (THROWS == ENoError) do
+
+/* TRY_DEFER(D) is TRY(D), but also accepts DEFER(FN, ARG) anywhere in its
+ * TRY and IN scopes, which registers FN(ARG) to run when the block exits.
+ * Cleanups run in LIFO order just before the FINALLY body, so only resources
+ * that were actually acquired are released, without nesting a TRY per
+ * resource:
+ *
+ * TRY_DEFER(FILE *in; char *buf) {
+ *     MAYBE(in = fopen(path, "r"), errno)
+ *     DEFER(close_file, in);
+ *     MAYBE(buf = (char*)malloc(n), EOutOfMemory)
+ *     DEFER(free, buf);
+ * } IN {
+ *   ...
+ *
+ * The cleanups live in a fixed array of LIBEX_DEFER_MAX entries on the stack;
+ * a DEFER that does not fit runs its cleanup immediately and raises
+ * EBufferUnavailable. */
+#ifndef LIBEX_DEFER_MAX
+#define LIBEX_DEFER_MAX 8
+#endif
+
+typedef struct ex_defer {
+	unsigned n;
+	struct {
+		void (*fn)(void*);
+		void *arg;
+	} stack[LIBEX_DEFER_MAX];
+} ex_defer;
+
+static inline void ex_defer_run(ex_defer *d) {
+	while (d->n != 0) {
+		--d->n;
+		d->stack[d->n].fn(d->stack[d->n].arg);
+	}
+}
+
+#define TRY_DEFER(D) TRY_WITH(ex_defer __ex_defer, __ex_defer.n = 0, ex_defer_run(&__ex_defer), D)
+
+#define DEFER(FN, ARG) { \
+	if (__ex_defer.n == LIBEX_DEFER_MAX) { (FN)(ARG); THROW(EBufferUnavailable) } \
+	__ex_defer.stack[__ex_defer.n].fn = (FN); \
+	__ex_defer.stack[__ex_defer.n++].arg = (ARG); }
+
+/* TRY_EACH(I, N, ACQUIRE, RELEASE, D) is TRY(D), but first acquires N
+ * resources by evaluating the exc_type expression ACQUIRE for I = 0..N-1,
+ * where I names a size_t index declared by the form. The first failure stops
+ * the loop and raises, skipping the TRY scope. What was acquired is recorded
+ * in a bitmap, and when the block exits RELEASE runs for every I still in it
+ * in reverse order, so exactly the acquired subset is released, before the
+ * FINALLY body:
+ *
+ * TRY_EACH(i, 512, (fds[i] = open(paths[i], O_RDONLY)) < 0 ? errno : ENoError, close(fds[i]), ) {
+ * } IN {
+ *   ...
+ *
+ * Since acquisition stops at the first failure, the acquired set is a prefix,
+ * so the loop does nothing per element beyond ACQUIRE and its test, and the
+ * bitmap is filled a word at a time afterwards. The IN scope may release some
+ * resources early and drop them from the bitmap with EACH_RELEASED(I), and
+ * the release walk skips empty words and tests the rest bit by bit. The
+ * bitmap holds LIBEX_EACH_MAX bits on the stack, and a larger N raises
+ * EArgumentInvalid. */
+#ifndef LIBEX_EACH_MAX
+#define LIBEX_EACH_MAX 1024
+#endif
+
+typedef struct ex_each {
+	size_t n;
+	uint64_t bits[(LIBEX_EACH_MAX + 63) / 64];
+} ex_each;
+
+/* record that resources [0, acquired) are held */
+static inline void ex_each_fill(ex_each *s, size_t acquired) {
+	size_t i;
+	s->n = acquired;
+	for (i = 0; i < acquired / 64; ++i) s->bits[i] = ~(uint64_t)0;
+	if (acquired % 64) s->bits[i] = ((uint64_t)1 << (acquired % 64)) - 1;
+}
+
+/* index of the highest bit set in w, which must not be 0 */
+static inline unsigned ex_msb64(uint64_t w) {
+#if defined(__GNUC__)
+	return 63 - (unsigned)__builtin_clzll(w);
+#else
+	unsigned b = 0;
+	while (w >>= 1) ++b;
+	return b;
+#endif
+}
+
+#define EACH_ACQUIRED(I) ((__ex_each.bits[(I) / 64] >> ((I) % 64)) & 1)
+#define EACH_RELEASED(I) (__ex_each.bits[(I) / 64] &= ~((uint64_t)1 << ((I) % 64)))
+
+#define __EX_EACH_ACQUIRE(I, N, ACQUIRE) { \
+	size_t I = 0, __ex_n = (N); \
+	exc_type __ex_acquired = __ex_n > LIBEX_EACH_MAX ? EArgumentInvalid : ENoError; \
+	for (; __ex_acquired == ENoError && I < __ex_n; ++I) { \
+		__ex_acquired = (exc_type)(ACQUIRE); \
+	} \
+	ex_each_fill(&__ex_each, __ex_acquired == ENoError ? I : I - (I != 0)); \
+	THROWS = __ex_acquired; }
+#define __EX_EACH_RELEASE(I, RELEASE) { \
+	size_t __ex_word = (__ex_each.n + 63) / 64; \
+	while (__ex_word-- > 0) { \
+		uint64_t __ex_bits = __ex_each.bits[__ex_word]; \
+		unsigned __ex_bit = __ex_bits ? ex_msb64(__ex_bits) + 1 : 0; \
+		__ex_each.bits[__ex_word] = 0; \
+		while (__ex_bit-- > 0) { \
+			size_t I = __ex_word * 64 + __ex_bit; \
+			if ((__ex_bits >> __ex_bit) & 1) { RELEASE; } \
+		} \
+	} }
+
+#define TRY_EACH(I, N, ACQUIRE, RELEASE, D) TRY_WITH(ex_each __ex_each, \
+	__EX_EACH_ACQUIRE(I, N, ACQUIRE), __EX_EACH_RELEASE(I, RELEASE), D)
+
+/* TRY_GROUP(D) is TRY(D), but its TRY scope may place several buffers in a
+ * single allocation with GROUP_ALLOC, listing each pointer and its size in
+ * bytes with GROUP(P, SIZE). The allocation is freed once when the block
+ * exits, and GROUP_ALLOC raises EOutOfMemory if it fails:
+ *
+ * TRY_GROUP(char *name; char *line; int *offsets) {
+ *     GROUP_ALLOC(GROUP(name, 256) GROUP(line, len + 1) GROUP(offsets, n * sizeof(int)))
+ * } IN {
+ *   ...
+ *
+ * Every buffer is aligned to LIBEX_GROUP_ALIGN. The list is walked twice,
+ * once to add up the sizes and once to carve the pointers, so the SIZE
+ * expressions must not have side effects. Use GROUP_ALLOC at most once per
+ * block. */
+#ifndef LIBEX_GROUP_ALIGN
+#define LIBEX_GROUP_ALIGN 16
+#endif
+
+typedef struct ex_group {
+	char *base;
+	size_t used;
+} ex_group;
+
+/* reserve size bytes, returning where they start once the group is allocated;
+ * a total that overflows saturates, and GROUP_ALLOC raises EOutOfMemory for
+ * any total larger than an object can be without calling malloc */
+static inline void *ex_group_take(ex_group *g, size_t size) {
+	size_t at = g->used;
+	size_t n = (size + (LIBEX_GROUP_ALIGN - 1)) & ~(size_t)(LIBEX_GROUP_ALIGN - 1);
+	g->used = n < size || n > SIZE_MAX - at ? SIZE_MAX : at + n;
+	return g->base == NULL ? NULL : g->base + at;
+}
+
+#define TRY_GROUP(D) TRY_WITH(ex_group __ex_group, __ex_group.base = NULL, free(__ex_group.base), D)
+
+#define GROUP(P, SIZE) (P) = ex_group_take(&__ex_group, (SIZE));
+
+#define GROUP_ALLOC(L) { \
+	__ex_group.used = 0; \
+	L \
+	if (__ex_group.used > PTRDIFF_MAX) THROW(EOutOfMemory) \
+	MAYBE(__ex_group.base = (char*)malloc(__ex_group.used), EOutOfMemory) \
+	__ex_group.used = 0; \
+	L }
+
+/* TRY_SCRATCH(P, N, D) is TRY(D), but first points P at a scratch buffer of
+ * N bytes, which is an inline buffer on the stack if N is at most
+ * LIBEX_SCRATCH_SIZE and allocated with malloc otherwise. P is an existing
+ * pointer variable, and the buffer lives until the block exits, when it is
+ * freed only if it came from the heap. A failed allocation raises
+ * EOutOfMemory:
+ *
+ * char *line;
+ * TRY_SCRATCH(line, len + 1, ) {
+ *     ERROR(read_line(fd, line, len))
+ * } IN {
+ *   ...
+ *
+ * The inline buffer is aligned for any scalar type and is part of the
+ * enclosing function's frame even when N does not fit. */
+#ifndef LIBEX_SCRATCH_SIZE
+#define LIBEX_SCRATCH_SIZE 1024
+#endif
+
+typedef struct ex_scratch {
+	void *heap;
+	union {
+		char bytes[LIBEX_SCRATCH_SIZE];
+		long double ld;
+		long long ll;
+		void *p;
+	} stack;
+} ex_scratch;
+
+static inline void *ex_scratch_get(ex_scratch *s, size_t n) {
+	s->heap = NULL;
+	if (n <= sizeof(s->stack.bytes)) return s->stack.bytes;
+	return s->heap = malloc(n);
+}
+
+#define TRY_SCRATCH(P, N, D) TRY_WITH(ex_scratch __ex_scratch, \
+	if (NULL == ((P) = ex_scratch_get(&__ex_scratch, (N)))) THROWS = EOutOfMemory, \
+	free(__ex_scratch.heap), D)
+
+/* thread-local and link-once storage for the opt-in extensions, so they can
+ * keep state in a header without requiring a separate translation unit */
+#if defined(_MSC_VER)
+#define LIBEX_TLS __declspec(thread)
+#define LIBEX_SHARED __declspec(selectany)
+#else
+#define LIBEX_TLS __thread
+#define LIBEX_SHARED __attribute__((weak))
+#endif
+
+/*
+ * Asynchronous exception sources, polled at every check point when enabled
+ * at compile time:
+ * LIBEX_DEADLINE: TRY_DEADLINE(ns, D) raises ETimedout once ns have elapsed.
+ * LIBEX_CANCEL: TRY_CANCELABLE(tok, D) raises ECanceled once tok is canceled.
+ */
+#ifdef LIBEX_POLL
+
+#ifdef LIBEX_DEADLINE
+#include "libex_deadline.h"
+#endif
+#ifdef LIBEX_CANCEL
+#include "libex_cancel.h"
+#endif
+
+static inline exc_type ex_poll(void) {
+#ifdef LIBEX_CANCEL
+	if (ex_canceled(ex_cancel_current)) return ex_cancel_raise();
+#endif
+#ifdef LIBEX_DEADLINE
+	if (ex_deadline_expired()) return ex_deadline_raise();
+#endif
+	return ENoError;
+}
+
+#endif /*LIBEX_POLL*/
+
 #endif /*__LIBEX__*/
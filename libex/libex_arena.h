@@ -0,0 +1,100 @@
+/*
+ * Bump allocation scoped to exception blocks.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * ex_arena arena;                         per request:
+ * ERROR(ex_arena_init(&arena, 1 << 20))   TRY_ARENA(&arena, char *line; item *items) {
+ *                                             ARENA_ALLOC(line, 4096)
+ *                                             ARENA_ALLOC(items, n * sizeof(item))
+ *                                         } IN {
+ *                                             ERROR(parse(line, items))
+ *                                         } HANDLE CATCHANY {
+ *                                             RETHROW;    ... rolling back line and items
+ *                                         } FINALLY {
+ *                                         }
+ *
+ * TRY_ARENA saves the arena's bump offset on entry. An exception propagating
+ * out of the block resets the arena to that offset, discarding every
+ * allocation made inside it, including those of nested blocks and callees,
+ * while a block that completes or is recovered by a handler keeps them. Both
+ * allocating and rolling back are a few instructions and never call malloc;
+ * the arena's memory is released all at once with ex_arena_reset() at the end
+ * of the request, or ex_arena_destroy().
+ *
+ * Allocation raises EOutOfMemory when the arena is exhausted, it never grows.
+ */
+
+#ifndef __LIBEX_ARENA__
+#define __LIBEX_ARENA__
+
+#include "libex.h"
+#include <stddef.h>
+
+/* alignment of every allocation, which must be a power of two */
+#ifndef LIBEX_ARENA_ALIGN
+#define LIBEX_ARENA_ALIGN 16
+#endif
+
+typedef struct ex_arena {
+	char *base;
+	size_t used, cap;
+} ex_arena;
+
+/* a saved bump offset */
+typedef struct ex_arena_mark {
+	ex_arena *arena;
+	size_t used;
+} ex_arena_mark;
+
+static inline exc_type ex_arena_init(ex_arena *a, size_t cap) {
+	THROWS(EOutOfMemory)
+	a->used = 0;
+	a->cap = cap;
+	/* an error means nothing was allocated, so do not poll */
+	MAYBE_UNPOLLED(a->base = (char*)malloc(cap), EOutOfMemory);
+	DONE;
+}
+
+static inline void ex_arena_destroy(ex_arena *a) {
+	free(a->base);
+	a->base = NULL;
+	a->used = a->cap = 0;
+}
+
+/* discard every allocation */
+static inline void ex_arena_reset(ex_arena *a) {
+	a->used = 0;
+}
+
+/* allocate size bytes, or return NULL if the arena is exhausted */
+static inline void *ex_arena_alloc(ex_arena *a, size_t size) {
+	size_t at = (a->used + (LIBEX_ARENA_ALIGN - 1)) & ~(size_t)(LIBEX_ARENA_ALIGN - 1);
+	if (size > a->cap || at > a->cap - size) return NULL;
+	a->used = at + size;
+	return a->base + at;
+}
+
+static inline ex_arena_mark ex_arena_save(ex_arena *a) {
+	ex_arena_mark m;
+	m.arena = a;
+	m.used = a->used;
+	return m;
+}
+
+static inline void ex_arena_rollback(ex_arena_mark m) {
+	m.arena->used = m.used;
+}
+
+/* TRY_ARENA(A, D) is TRY(D), but rolls the arena A back to where it was on
+ * entry if an exception propagates out of the block */
+#define TRY_ARENA(A, D) TRY_WITH(ex_arena_mark __ex_arena = ex_arena_save(A), , \
+	if (THROWS != ENoError && THROWS != EEarlyReturn) ex_arena_rollback(__ex_arena), D)
+
+/* ARENA_ALLOC(P, SIZE) allocates SIZE bytes from the arena of the enclosing
+ * TRY_ARENA into P, raising EOutOfMemory if it is exhausted */
+#define ARENA_ALLOC(P, SIZE) MAYBE((P) = ex_arena_alloc(__ex_arena.arena, (SIZE)), EOutOfMemory)
+
+#endif /*__LIBEX_ARENA__*/
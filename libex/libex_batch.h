@@ -0,0 +1,163 @@
+/*
+ * Batched datagram I/O with an exception per message.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * struct mmsghdr msgs[32];
+ * ex_batch batch;
+ * ... point each msgs[i] at a destination and a payload
+ * TRY() {
+ *     ERROR(ex_sendmmsg(sock, msgs, 32, 0, &batch))
+ * } IN {
+ *     if (batch.failed != 0) {
+ *         FOR_EACH_FAILED(i, batch) {
+ *             ... msgs[i] was not sent, because of batch.err[i]
+ *         }
+ *     }
+ * } HANDLE CATCH (EWouldBlock) {
+ *     ... nothing was sent, wait for the socket to become writable
+ * } FINALLY {
+ * }
+ *
+ * recvmmsg and sendmmsg handle many datagrams per call, and each one can
+ * succeed or fail on its own. ex_recvmmsg and ex_sendmmsg fill an ex_batch
+ * with the outcome of each: a bitmap with a bit set for every message that
+ * succeeded, the exception of each message in err, ENoError for those that
+ * succeeded, and the number that failed. The batch as a whole raises only
+ * when the call itself fails, before any message was handled, so the hot
+ * path is one test of batch.failed per batch, and FOR_EACH_FAILED(I, B)
+ * walks the failures alone, a bitmap word at a time, declaring size_t I.
+ * Inside it, break and continue both move on to the next failure.
+ *
+ * ex_sendmmsg resumes after a message the kernel rejects, such as one too
+ * big (EMessageTooBig) or to an unreachable address, recording its exception
+ * and sending the rest. If the socket fills up (EWouldBlock or
+ * EBufferUnavailable) part way, the messages not yet sent are marked with
+ * that exception, to be sent again later. ex_recvmmsg receives up to n
+ * messages without waiting for more once one has arrived, and marks those
+ * cut short to fit their buffers with EMessageTooBig. Batches hold up to
+ * LIBEX_BATCH messages, and a larger n raises EArgumentInvalid. Neither call
+ * polls a deadline or a cancellation token once the kernel has taken or
+ * delivered messages, so their outcome always reaches the caller.
+ *
+ * Linux only, compiled with _GNU_SOURCE for recvmmsg and sendmmsg.
+ */
+
+#ifndef __LIBEX_BATCH__
+#define __LIBEX_BATCH__
+
+#include "libex.h"
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifndef LIBEX_BATCH
+#define LIBEX_BATCH 64
+#endif
+
+typedef struct ex_batch {
+	unsigned count;		/* messages in the batch */
+	unsigned failed;	/* of those, how many failed */
+	uint64_t ok[(LIBEX_BATCH + 63) / 64];
+	exc_type err[LIBEX_BATCH];
+} ex_batch;
+
+/* index of the lowest bit set in w, which must not be 0 */
+static inline unsigned ex_lsb64(uint64_t w) {
+#if defined(__GNUC__)
+	return (unsigned)__builtin_ctzll(w);
+#else
+	unsigned b = 0;
+	while (!(w & 1)) w >>= 1, ++b;
+	return b;
+#endif
+}
+
+static inline void ex_batch_start(ex_batch *b, unsigned count) {
+	unsigned i;
+	b->count = count;
+	b->failed = 0;
+	for (i = 0; i < (count + 63) / 64; ++i) b->ok[i] = 0;
+}
+
+static inline void ex_batch_succeed(ex_batch *b, unsigned i) {
+	b->ok[i / 64] |= (uint64_t)1 << (i % 64);
+	b->err[i] = ENoError;
+}
+
+static inline void ex_batch_fail(ex_batch *b, unsigned i, exc_type e) {
+	b->err[i] = e;
+	++b->failed;
+}
+
+/* the failed messages among the 64 from 64 * word, as a bitmap */
+static inline uint64_t ex_batch_failures(const ex_batch *b, size_t word) {
+	uint64_t missing = ~b->ok[word];
+	size_t end = b->count - word * 64;
+	return end < 64 ? missing & (((uint64_t)1 << end) - 1) : missing;
+}
+
+#define FOR_EACH_FAILED(I, B) \
+	for (size_t __ex_word = 0; (B).failed != 0 && __ex_word < ((B).count + 63) / 64; ++__ex_word) \
+	for (uint64_t __ex_bits = ex_batch_failures(&(B), __ex_word); __ex_bits != 0; __ex_bits &= __ex_bits - 1) \
+	for (size_t I = __ex_word * 64 + ex_lsb64(__ex_bits), __ex_once = 1; __ex_once; __ex_once = 0)
+
+/* errors after which no further message in the call can succeed */
+static inline int ex_batch_stops(exc_type e) {
+	return e == EWouldBlock || e == EResourceUnavailable || e == EBufferUnavailable
+		|| e == EOutOfMemory || e == EBadDescriptor || e == EInvalidSocket;
+}
+
+/* send n messages, recording the outcome of each in b */
+static inline exc_type ex_sendmmsg(int fd, struct mmsghdr *msgs, unsigned n, int flags, ex_batch *b) {
+	THROWS(EWouldBlock, ...)
+	unsigned i = 0;
+	ERRORE(n > LIBEX_BATCH, EArgumentInvalid);
+	ex_batch_start(b, n);
+	while (i < n) {
+		int r = sendmmsg(fd, msgs + i, n - i, flags);
+		exc_type e;
+		if (r > 0) {
+			for (; r > 0; --r, ++i) ex_batch_succeed(b, i);
+			continue;
+		}
+		e = r == 0 ? EWouldBlock : (exc_type)errno;
+		if (e == EInterrupted) continue;
+		if (!ex_batch_stops(e)) {
+			/* only the message at i failed; carry on after it */
+			ex_batch_fail(b, i++, e);
+			continue;
+		}
+		if (i == 0) THROW(e)
+		for (; i < n; ++i) ex_batch_fail(b, i, e);
+	}
+	/* once messages are sent only the call's own failure raises, so the
+	 * caller never resends what already went out */
+	THROWONERROR_UNPOLLED;
+	DONE;
+}
+
+/* receive up to n messages, recording the outcome of each in b */
+static inline exc_type ex_recvmmsg(int fd, struct mmsghdr *msgs, unsigned n, int flags, ex_batch *b) {
+	THROWS(EWouldBlock, ...)
+	int r;
+	unsigned i;
+	ERRORE(n > LIBEX_BATCH, EArgumentInvalid);
+	do {
+		r = recvmmsg(fd, msgs, n, flags | MSG_WAITFORONE, NULL);
+	} while (r < 0 && errno == EINTR);
+	/* not a check point: received datagrams must reach the caller */
+	ERRORE_UNPOLLED(r < 0, errno);
+	ex_batch_start(b, (unsigned)r);
+	for (i = 0; i < (unsigned)r; ++i) {
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			ex_batch_fail(b, i, EMessageTooBig);
+		} else {
+			ex_batch_succeed(b, i);
+		}
+	}
+	DONE;
+}
+
+#endif /*__LIBEX_BATCH__*/
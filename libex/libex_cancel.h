@@ -0,0 +1,99 @@
+/*
+ * Cross-thread cancellation delivered as ECanceled.
+ *
+ * LICENSE: LGPL
+ *
+ * Compile with LIBEX_CANCEL defined, and libex.h pulls this in and polls the
+ * current thread's cancellation token at every check point (THROWONERROR,
+ * ERROR, CHECK, MAYBE, ERRORE, and the entry of every TRY). Example:
+ *
+ * ex_cancel_token tok = EX_CANCEL_TOKEN_INIT;
+ *
+ * worker thread:                          any other thread:
+ * TRY_CANCELABLE(&tok, char *foo) {       ex_cancel(&tok);
+ *     MAYBE(foo = read_request(), errno)
+ * } IN {
+ *     ERROR(process(foo))
+ * } HANDLE CATCH (ECanceled) {
+ *     ... client went away
+ * } FINALLY {
+ * }
+ *
+ * Cancellation is cooperative: it is observed at the next check point, so
+ * every FINALLY still runs. Tight loops without check points can poll with
+ * CANCELPOINT, which exits the loop with the exception set like any THROW, so
+ * the loop must be followed by a THROWONERROR.
+ *
+ * Polling costs one relaxed load: a thread with no token installed polls a
+ * token that is never canceled. Only the innermost token is polled, so nested
+ * blocks that should be canceled together must share a token.
+ *
+ * ECanceled is raised once: from then until the block exits, check points no
+ * longer poll its token, so the handlers and the cleanup of the blocks it
+ * unwinds can still call into libex. An enclosing block polling the same
+ * canceled token stays quiet while ECanceled propagates through it, and only
+ * raises again in a block that handled the exception and carried on.
+ */
+
+#ifndef __LIBEX_CANCEL__
+#define __LIBEX_CANCEL__
+
+#include "libex.h"
+#include <stdatomic.h>
+
+/* one cancellation flag per task, set from any thread */
+typedef struct ex_cancel_token {
+	atomic_int canceled;
+} ex_cancel_token;
+
+#define EX_CANCEL_TOKEN_INIT { 0 }
+
+/* polled by threads that have no token installed */
+LIBEX_SHARED ex_cancel_token ex_cancel_never = EX_CANCEL_TOKEN_INIT;
+
+/* polled in place of a token that has raised ECanceled */
+LIBEX_SHARED ex_cancel_token ex_cancel_raised = EX_CANCEL_TOKEN_INIT;
+
+/* the token polled by the current thread */
+LIBEX_SHARED LIBEX_TLS ex_cancel_token *ex_cancel_current = &ex_cancel_never;
+
+/* request cancellation of every block polling tok */
+static inline void ex_cancel(ex_cancel_token *tok) {
+	atomic_store_explicit(&tok->canceled, 1, memory_order_relaxed);
+}
+
+/* make tok usable for a new task */
+static inline void ex_cancel_reset(ex_cancel_token *tok) {
+	atomic_store_explicit(&tok->canceled, 0, memory_order_relaxed);
+}
+
+static inline int ex_canceled(ex_cancel_token *tok) {
+	return atomic_load_explicit(&tok->canceled, memory_order_relaxed);
+}
+
+/* install tok as the current thread's token, returning the previous one */
+static inline ex_cancel_token *ex_cancel_push(ex_cancel_token *tok) {
+	ex_cancel_token *saved = ex_cancel_current;
+	ex_cancel_current = tok;
+	return saved;
+}
+
+/* restore the token saved by ex_cancel_push as a block exits with e */
+static inline void ex_cancel_pop(ex_cancel_token *saved, exc_type e) {
+	/* the enclosing block was canceled too, and is already being unwound */
+	if (ex_cancel_current == &ex_cancel_raised && e == ECanceled && ex_canceled(saved)) return;
+	ex_cancel_current = saved;
+}
+
+/* stop polling the canceled token, and return the exception it raises */
+static inline exc_type ex_cancel_raise(void) {
+	ex_cancel_current = &ex_cancel_raised;
+	return ECanceled;
+}
+
+/* TRY_CANCELABLE(TOK, D) is TRY(D), but raises ECanceled at the first check
+ * point reached after TOK was canceled */
+#define TRY_CANCELABLE(TOK, D) TRY_WITH(ex_cancel_token *__ex_cancel = ex_cancel_push(TOK), , \
+	ex_cancel_pop(__ex_cancel, THROWS), D)
+
+#endif /*__LIBEX_CANCEL__*/
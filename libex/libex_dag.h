@@ -0,0 +1,309 @@
+/*
+ * Work-stealing scheduler for DAGs of libex-style tasks.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * ex_task tasks[3];
+ * ex_dag_report report;
+ * ex_task_init(&tasks[0], fetch, NULL, ctx);
+ * ex_task_init(&tasks[1], parse, NULL, ctx);
+ * ex_task_init(&tasks[2], store, store_failed, ctx);
+ * TRY() {
+ *     ERROR(ex_task_after(&tasks[1], &tasks[0]))
+ *     ERROR(ex_task_after(&tasks[2], &tasks[1]))
+ * } IN {
+ *     ERROR(ex_dag_run(&pool, tasks, 3, &report))
+ * } HANDLE CATCHANY {
+ *     ... report.first lists every task that did not succeed
+ * } FINALLY {
+ *     ex_dag_destroy(tasks, 3);
+ * }
+ *
+ * Every worker of the pool owns a Chase-Lev deque: it pushes the tasks it
+ * makes ready onto its own deque and pops them LIFO, and steals FIFO from the
+ * others when it runs dry, so there is no global queue.
+ *
+ * A task that ends with an exception poisons its dependents. A poisoned task
+ * does not run; its handler runs instead, as a CATCH clause would, and its
+ * result becomes the task's result, so a handler returning ENoError recovers
+ * and lets the dependents run normally. A poisoned task without a handler is
+ * skipped, and passes the exception on to its own dependents. Independent
+ * branches keep running either way.
+ *
+ * The tasks must form a DAG, and every dependency of a task must be among the
+ * tasks handed to ex_dag_run with it, or some task would wait forever.
+ * ex_dag_run checks this before it runs anything, raising EDeadlock for a
+ * cycle and EArgumentInvalid for a dependency on a task outside the graph.
+ */
+
+#ifndef __LIBEX_DAG__
+#define __LIBEX_DAG__
+
+#include "libex.h"
+#include "libex_parallel.h"
+#include <sched.h>
+
+typedef exc_type (*ex_task_fn)(void *ctx);
+
+/* runs instead of the task when dependency raised e */
+typedef exc_type (*ex_task_handler)(void *ctx, exc_type e);
+
+typedef struct ex_task {
+	ex_task_fn run;
+	ex_task_handler handler;
+	void *ctx;
+	struct ex_task **dependents;
+	size_t ndependents, npreds;
+	atomic_size_t pending;		/* dependencies still to finish */
+	atomic_int poison;		/* first exception of a dependency */
+	exc_type result;
+	int skipped;			/* poisoned without a handler */
+	struct ex_task *next_failed;
+} ex_task;
+
+/* the tasks that did not finish with ENoError, linked through next_failed */
+typedef struct ex_dag_report {
+	ex_task *first;
+	size_t failed, skipped;
+} ex_dag_report;
+
+static inline void ex_task_init(ex_task *t, ex_task_fn run, ex_task_handler handler, void *ctx) {
+	t->run = run;
+	t->handler = handler;
+	t->ctx = ctx;
+	t->dependents = NULL;
+	t->ndependents = 0;
+	t->npreds = 0;
+	t->result = ENoError;
+	t->skipped = 0;
+	t->next_failed = NULL;
+}
+
+/* make t run only after dep has finished */
+static inline exc_type ex_task_after(ex_task *t, ex_task *dep) {
+	THROWS(EOutOfMemory)
+	ex_task **grown;
+	/* realloc may have freed the old array, so nothing polls until the
+	 * new one is stored */
+	MAYBE_UNPOLLED(grown = (ex_task**)realloc(dep->dependents, (dep->ndependents + 1) * sizeof(ex_task*)), EOutOfMemory);
+	dep->dependents = grown;
+	dep->dependents[dep->ndependents++] = t;
+	++t->npreds;
+	DONE;
+}
+
+static inline void ex_dag_destroy(ex_task *tasks, size_t n) {
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		free(tasks[i].dependents);
+		tasks[i].dependents = NULL;
+		tasks[i].ndependents = 0;
+	}
+}
+
+/* a Chase-Lev deque of fixed capacity, which must be a power of two no less
+ * than the number of tasks, so it never needs to grow */
+typedef struct ex_deque {
+	atomic_llong top, bottom;
+	_Atomic(ex_task*) *buf;
+	long long mask;
+} ex_deque;
+
+/* owner only */
+static inline void ex_deque_push(ex_deque *q, ex_task *t) {
+	long long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	atomic_store_explicit(&q->buf[b & q->mask], t, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+/* owner only */
+static inline ex_task *ex_deque_pop(ex_deque *q) {
+	long long b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+	long long t;
+	ex_task *x = NULL;
+	atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&q->top, memory_order_relaxed);
+	if (t <= b) {
+		x = atomic_load_explicit(&q->buf[b & q->mask], memory_order_relaxed);
+		if (t == b) {
+			/* last element, race the thieves for it */
+			if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) x = NULL;
+			atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+		}
+	} else {
+		atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+	}
+	return x;
+}
+
+/* any thread */
+static inline ex_task *ex_deque_steal(ex_deque *q) {
+	long long t = atomic_load_explicit(&q->top, memory_order_acquire);
+	long long b;
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+	if (t < b) {
+		ex_task *x = atomic_load_explicit(&q->buf[t & q->mask], memory_order_relaxed);
+		if (atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) return x;
+	}
+	return NULL;
+}
+
+/* check that the n tasks form a DAG closed under their dependencies, by
+ * running Kahn's algorithm over them without running any task */
+static inline exc_type ex_dag_check(ex_task *tasks, size_t n) {
+	THROWS(EArgumentInvalid, EDeadlock)
+	ex_task *ready = NULL;
+	size_t i, j, sorted = 0;
+	for (i = 0; i < n; ++i) atomic_init(&tasks[i].pending, 0);
+	for (i = 0; i < n && THROWS == ENoError; ++i) {
+		for (j = 0; j < tasks[i].ndependents; ++j) {
+			ex_task *d = tasks[i].dependents[j];
+			if (d < tasks || d >= tasks + n) THROW(EArgumentInvalid)
+			atomic_fetch_add_explicit(&d->pending, 1, memory_order_relaxed);
+		}
+	}
+	THROWONERROR;
+	for (i = 0; i < n; ++i) {
+		/* a dependency from outside the graph would never finish */
+		if (atomic_load_explicit(&tasks[i].pending, memory_order_relaxed) != tasks[i].npreds) THROW(EArgumentInvalid)
+		if (tasks[i].npreds == 0) {
+			tasks[i].next_failed = ready;
+			ready = &tasks[i];
+		}
+	}
+	THROWONERROR;
+	while (ready != NULL) {
+		ex_task *t = ready;
+		ready = t->next_failed;
+		++sorted;
+		for (j = 0; j < t->ndependents; ++j) {
+			ex_task *d = t->dependents[j];
+			if (atomic_fetch_sub_explicit(&d->pending, 1, memory_order_relaxed) == 1) {
+				d->next_failed = ready;
+				ready = d;
+			}
+		}
+	}
+	/* whatever never became ready is on a cycle, or waits on one */
+	ERRORE(sorted != n, EDeadlock);
+	DONE;
+}
+
+typedef struct ex_dag {
+	ex_deque *deques;
+	size_t ndeques;
+	atomic_size_t remaining;
+	_Atomic(ex_task*) failed;
+} ex_dag;
+
+static inline void ex_dag_exec(ex_dag *dag, ex_deque *own, ex_task *t) {
+	exc_type e = (exc_type)atomic_load_explicit(&t->poison, memory_order_relaxed);
+	size_t i;
+	if (e == ENoError) {
+		t->result = t->run(t->ctx);
+	} else if (t->handler != NULL) {
+		t->result = t->handler(t->ctx, e);
+	} else {
+		t->result = e;
+		t->skipped = 1;
+	}
+	if (t->result != ENoError) {
+		t->next_failed = atomic_load_explicit(&dag->failed, memory_order_relaxed);
+		while (!atomic_compare_exchange_weak(&dag->failed, &t->next_failed, t));
+	}
+	for (i = 0; i < t->ndependents; ++i) {
+		ex_task *d = t->dependents[i];
+		if (t->result != ENoError) {
+			int none = ENoError;
+			atomic_compare_exchange_strong_explicit(&d->poison, &none, t->result, memory_order_relaxed, memory_order_relaxed);
+		}
+		/* the last dependency to finish makes d ready */
+		if (atomic_fetch_sub_explicit(&d->pending, 1, memory_order_acq_rel) == 1) ex_deque_push(own, d);
+	}
+	atomic_fetch_sub_explicit(&dag->remaining, 1, memory_order_release);
+}
+
+/* one worker per deque, run by the pool as a parallel loop over the deques */
+static inline exc_type ex_dag_worker(void *ctx, size_t begin, size_t end) {
+	THROWS()
+	ex_dag *dag = (ex_dag*)ctx;
+	ex_deque *own = &dag->deques[begin];
+	size_t victim = begin;
+	(void)end;
+	while (atomic_load_explicit(&dag->remaining, memory_order_acquire) != 0) {
+		ex_task *t = ex_deque_pop(own);
+		size_t i;
+		for (i = 1; t == NULL && i < dag->ndeques; ++i) {
+			victim = (victim + 1) % dag->ndeques;
+			if (victim != begin) t = ex_deque_steal(&dag->deques[victim]);
+		}
+		if (t == NULL) {
+			sched_yield();
+		} else {
+			ex_dag_exec(dag, own, t);
+		}
+	}
+	DONE;
+}
+
+/* run the n tasks on the pool, filling in report, and return the exception
+ * of the lowest-index task that failed by itself rather than being skipped */
+static inline exc_type ex_dag_run(ex_pool *pool, ex_task *tasks, size_t n, ex_dag_report *report) {
+	THROWS(...)
+	ex_dag dag;
+	exc_type first = ENoError;
+	_Atomic(ex_task*) *bufs = NULL;
+	size_t cap = 1, i;
+	report->first = NULL;
+	report->failed = report->skipped = 0;
+	dag.ndeques = pool->nthreads;
+	dag.deques = NULL;
+	atomic_init(&dag.remaining, n);
+	atomic_init(&dag.failed, NULL);
+	while (cap < n) cap *= 2;
+	ERROR(ex_dag_check(tasks, n));
+	TRY() {
+		MAYBE(dag.deques = (ex_deque*)malloc(dag.ndeques * sizeof(ex_deque)), EOutOfMemory);
+		MAYBE(bufs = (_Atomic(ex_task*)*)malloc(dag.ndeques * cap * sizeof(ex_task*)), EOutOfMemory);
+	} IN {
+		for (i = 0; i < dag.ndeques; ++i) {
+			atomic_init(&dag.deques[i].top, 0);
+			atomic_init(&dag.deques[i].bottom, 0);
+			dag.deques[i].buf = bufs + i * cap;
+			dag.deques[i].mask = (long long)cap - 1;
+		}
+		for (i = 0; i < n; ++i) {
+			atomic_init(&tasks[i].pending, tasks[i].npreds);
+			atomic_init(&tasks[i].poison, ENoError);
+			tasks[i].result = ENoError;
+			tasks[i].skipped = 0;
+			tasks[i].next_failed = NULL;
+		}
+		/* deal the roots out to the workers before any of them starts */
+		for (i = 0; i < n; ++i) {
+			if (tasks[i].npreds == 0) ex_deque_push(&dag.deques[i % dag.ndeques], &tasks[i]);
+		}
+		ERROR(ex_parallel_for(pool, dag.ndeques, 1, ex_dag_worker, &dag));
+		report->first = atomic_load(&dag.failed);
+		for (i = 0; i < n; ++i) {
+			if (tasks[i].result == ENoError) continue;
+			++report->failed;
+			report->skipped += tasks[i].skipped;
+			if (!tasks[i].skipped && first == ENoError) first = tasks[i].result;
+		}
+		ERROR(first);
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		free(bufs);
+		free(dag.deques);
+	}
+	DONE;
+}
+
+#endif /*__LIBEX_DAG__*/
@@ -0,0 +1,102 @@
+/*
+ * Deadline-scoped exception blocks.
+ *
+ * LICENSE: LGPL
+ *
+ * Compile with LIBEX_DEADLINE defined, and libex.h pulls this in and polls the
+ * deadline at every check point (THROWONERROR, ERROR, CHECK, and the entry of
+ * every TRY). Example:
+ *
+ * TRY_DEADLINE(5000000, char *foo) {
+ *     ERROR(parse(&foo))
+ * } IN {
+ *     ERROR(process(foo))
+ * } HANDLE CATCH (ETimedout) {
+ *     ... took longer than 5ms
+ * } FINALLY {
+ * }
+ *
+ * The deadline is per-thread, so check points in callees see it too. Nested
+ * deadlines can only tighten the enclosing one, never extend it, and the
+ * previous deadline is restored when the block exits.
+ *
+ * ETimedout is raised once: from then until the block exits, check points
+ * no longer poll the deadline, so the handlers and the cleanup of the
+ * blocks it unwinds can still call into libex. If an enclosing deadline has
+ * passed as well, it stays quiet while ETimedout propagates through its
+ * block, and is only raised again in a block that handled the exception and
+ * carried on. A TRY_DEADLINE inside a handler starts a fresh deadline.
+ *
+ * The clock is CLOCK_MONOTONIC_COARSE where available, which costs a few
+ * cycles to read but only advances once per scheduler tick (1-4ms), so short
+ * deadlines may overshoot by up to one tick. With no deadline installed a
+ * check point costs one thread-local load and a branch.
+ */
+
+#ifndef __LIBEX_DEADLINE__
+#define __LIBEX_DEADLINE__
+
+#include "libex.h"
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define LIBEX_DEADLINE_CLOCK CLOCK_MONOTONIC_COARSE
+#elif !defined(_WIN32)
+#define LIBEX_DEADLINE_CLOCK CLOCK_MONOTONIC
+#endif
+
+/* the absolute deadline of the current thread in ns, 0 if there is none, or
+ * EX_DEADLINE_RAISED once it has raised ETimedout */
+LIBEX_SHARED LIBEX_TLS uint64_t ex_deadline_at = 0;
+
+#define EX_DEADLINE_RAISED UINT64_MAX
+
+/* the current time in ns on the deadline clock */
+static inline uint64_t ex_deadline_now(void) {
+#if defined(_WIN32)
+	return (uint64_t)GetTickCount64() * 1000000;
+#else
+	struct timespec ts;
+	clock_gettime(LIBEX_DEADLINE_CLOCK, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* install a deadline ns from now unless the current one is sooner, and return
+ * the previous deadline so it can be restored */
+static inline uint64_t ex_deadline_push(uint64_t ns) {
+	uint64_t saved = ex_deadline_at;
+	uint64_t at = ex_deadline_now() + ns;
+	if (saved == 0 || at < saved) ex_deadline_at = at;
+	return saved;
+}
+
+/* restore the deadline saved by ex_deadline_push as a block exits with e */
+static inline void ex_deadline_pop(uint64_t saved, exc_type e) {
+	/* the enclosing deadline has passed too, and is already being raised */
+	if (ex_deadline_at == EX_DEADLINE_RAISED && e == ETimedout && saved != 0 && saved <= ex_deadline_now()) return;
+	ex_deadline_at = saved;
+}
+
+static inline int ex_deadline_expired(void) {
+	return ex_deadline_at != 0 && ex_deadline_at != EX_DEADLINE_RAISED && ex_deadline_now() >= ex_deadline_at;
+}
+
+/* stop polling the expired deadline, and return the exception it raises */
+static inline exc_type ex_deadline_raise(void) {
+	ex_deadline_at = EX_DEADLINE_RAISED;
+	return ETimedout;
+}
+
+/* TRY_DEADLINE(NS, D) is TRY(D), but raises ETimedout at the first check point
+ * reached NS nanoseconds or more after entering the block */
+#define TRY_DEADLINE(NS, D) TRY_WITH(uint64_t __ex_deadline = ex_deadline_push(NS), , \
+	ex_deadline_pop(__ex_deadline, THROWS), D)
+
+#endif /*__LIBEX_DEADLINE__*/
@@ -0,0 +1,134 @@
+/*
+ * Transactional file writes, published only when a block succeeds.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * int fd;
+ * TRY_FILE_TXN(fd, "/var/lib/app/state.json", ) {
+ * } IN {
+ *     ERROR(write_all(fd, buf, len))
+ * } HANDLE CATCHANY {
+ *     ... the old state.json, if any, is untouched
+ * } FINALLY {
+ * }
+ *
+ * TRY_FILE_TXN opens an anonymous O_TMPFILE in the target's directory into
+ * the existing int FD, so the data has no name while it is being written.
+ * When the block exits with no exception propagating, the file is flushed
+ * with fdatasync, linked into place with linkat and the directory synced,
+ * and a failure in any of those propagates instead. An existing file is
+ * replaced atomically by linking under a fresh name and renaming that over
+ * it, since linkat never overwrites. On every other exit the descriptor is
+ * just closed, which drops the inode: there is no temporary name to race on
+ * and nothing to unlink.
+ *
+ * Linux only, compiled with _GNU_SOURCE for O_TMPFILE, and the filesystem
+ * must support it; if it does not, entering the block raises EUnsupported or
+ * EIsDirectory.
+ */
+
+#ifndef __LIBEX_FILETXN__
+#define __LIBEX_FILETXN__
+
+#include "libex.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#ifndef LIBEX_FILE_TXN_MODE
+#define LIBEX_FILE_TXN_MODE 0666
+#endif
+
+typedef struct ex_file_txn {
+	int fd, dirfd;
+	const char *name;	/* the target's last component, within dirfd */
+} ex_file_txn;
+
+/* open the target's directory and an unnamed file in it */
+static inline exc_type ex_file_txn_begin(ex_file_txn *t, const char *path) {
+	THROWS(ENameTooLong, ...)
+	char dir[PATH_MAX];
+	const char *slash = strrchr(path, '/');
+	t->fd = t->dirfd = -1;
+	t->name = slash == NULL ? path : slash + 1;
+	ERRORE(*t->name == '\0', EArgumentInvalid);
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	} else if (slash == path) {
+		strcpy(dir, "/");
+	} else {
+		ERRORE((size_t)(slash - path) >= sizeof(dir), ENameTooLong);
+		memcpy(dir, path, slash - path);
+		dir[slash - path] = '\0';
+	}
+	/* nothing polls once a descriptor is open, so none is left behind */
+	ERRORE_UNPOLLED(-1 == (t->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)), errno);
+	if (-1 == (t->fd = openat(t->dirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, LIBEX_FILE_TXN_MODE))) {
+		THROWS = (exc_type)errno;
+		close(t->dirfd);
+		t->dirfd = -1;
+	}
+	DONE;
+}
+
+/* give the file its name, replacing any file already there */
+static inline exc_type ex_file_txn_link(ex_file_txn *t) {
+	THROWS(...)
+	char proc[64], tmp[NAME_MAX + 1];
+	unsigned attempt;
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", t->fd);
+	if (0 == linkat(AT_FDCWD, proc, t->dirfd, t->name, AT_SYMLINK_FOLLOW)) RETURN;
+	ERRORE(errno != EEXIST, errno);
+	/* link under a name nobody else uses, then rename it over the target */
+	for (attempt = 0; ; ++attempt) {
+		ERRORE(attempt == 100, EFileExists);
+		ERRORE(snprintf(tmp, sizeof(tmp), ".%.200s.%ld.%u", t->name, (long)getpid(), attempt) >= (int)sizeof(tmp), ENameTooLong);
+		if (0 == linkat(AT_FDCWD, proc, t->dirfd, tmp, AT_SYMLINK_FOLLOW)) break;
+		ERRORE(errno != EEXIST, errno);
+	}
+	/* the temporary name exists from here on, so nothing polls until it has
+	 * been renamed over the target or unlinked */
+	THROWONERROR_UNPOLLED;
+	if (0 != renameat(t->dirfd, tmp, t->dirfd, t->name)) {
+		THROWS = (exc_type)errno;
+		unlinkat(t->dirfd, tmp, 0);
+	}
+	DONE;
+}
+
+static inline exc_type ex_file_txn_commit(ex_file_txn *t) {
+	THROWS(...)
+	ERRORE(0 != fdatasync(t->fd), errno);
+	/* once published, only a real failure may say otherwise */
+	ERROR_UNPOLLED(ex_file_txn_link(t));
+	ERRORE_UNPOLLED(0 != fsync(t->dirfd), errno);
+	DONE;
+}
+
+/* publish the file if e is not an exception, and close it, returning the
+ * exception propagating out of the block */
+static inline exc_type ex_file_txn_end(ex_file_txn *t, exc_type e) {
+	if (t->fd != -1) {
+		if (e == ENoError || e == EEarlyReturn) {
+			exc_type c = ex_file_txn_commit(t);
+			if (c != ENoError) e = c;
+		}
+		close(t->fd);
+	}
+	if (t->dirfd != -1) close(t->dirfd);
+	t->fd = t->dirfd = -1;
+	return e;
+}
+
+/* TRY_FILE_TXN(FD, PATH, D) is TRY(D), but first opens an unnamed file in
+ * PATH's directory into FD, which is published at PATH only if no exception
+ * propagates out of the block, and closed either way */
+#define TRY_FILE_TXN(FD, PATH, D) TRY_WITH(ex_file_txn __ex_file_txn, \
+	if (ENoError == (THROWS = ex_file_txn_begin(&__ex_file_txn, (PATH)))) (FD) = __ex_file_txn.fd, \
+	(THROWS = ex_file_txn_end(&__ex_file_txn, THROWS), (FD) = -1), D)
+
+#endif /*__LIBEX_FILETXN__*/
@@ -0,0 +1,119 @@
+/*
+ * Futures carrying either a value or an exception across threads.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * ex_future f;                            producer thread:
+ * ex_value v;                             TRY(...) {
+ * ex_future_init(&f);                         ...
+ * ... hand &f to the producer             } IN {
+ * TRY() {                                     ex_value v = { .i = 42 };
+ *     AWAIT(&f, v)                            ex_promise_resolve(&f, v);
+ * } IN {                                  } HANDLE CATCHANY {
+ *     ... use v.i                             PROMISE_FAIL(&f, __CUR_EXC__);
+ * } HANDLE CATCH (EIOError) {             } FINALLY {
+ *     ... f.ctx says where it was raised  }
+ * } FINALLY {
+ * }
+ *
+ * AWAIT raises the producer's exception in the consumer exactly as though it
+ * had been thrown locally, and f.ctx records the file, function and line
+ * where the producer failed. A future is a plain struct that is resolved
+ * exactly once, so it needs no allocation, and waiting uses a futex that is
+ * only woken if somebody is actually blocked on it.
+ */
+
+#ifndef __LIBEX_FUTURE__
+#define __LIBEX_FUTURE__
+
+#include "libex.h"
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+typedef union ex_value {
+	void *p;
+	intptr_t i;
+	uint64_t u;
+	double d;
+} ex_value;
+
+/* where an exception was raised */
+typedef struct ex_context {
+	exc_type exc;
+	const char *file;
+	const char *func;
+	int line;
+} ex_context;
+
+enum { EX_FUTURE_PENDING, EX_FUTURE_WAITING, EX_FUTURE_READY };
+
+typedef struct ex_future {
+	atomic_int state;
+	ex_value value;
+	ex_context ctx;		/* ctx.exc is ENoError when value is set */
+} ex_future;
+
+static inline void ex_futex_wait(atomic_int *addr, int val) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void ex_futex_wake(atomic_int *addr, int n) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static inline void ex_future_init(ex_future *f) {
+	atomic_init(&f->state, EX_FUTURE_PENDING);
+	f->ctx.exc = ENoError;
+	f->ctx.file = f->ctx.func = NULL;
+	f->ctx.line = 0;
+}
+
+static inline void ex_future_publish(ex_future *f) {
+	if (atomic_exchange_explicit(&f->state, EX_FUTURE_READY, memory_order_release) == EX_FUTURE_WAITING)
+		ex_futex_wake(&f->state, INT_MAX);
+}
+
+static inline void ex_promise_resolve(ex_future *f, ex_value v) {
+	f->value = v;
+	ex_future_publish(f);
+}
+
+/* fail f with e; ENoError would complete it with no value, so it fails
+ * with EArgumentInvalid instead */
+static inline void ex_promise_fail(ex_future *f, exc_type e, const char *file, const char *func, int line) {
+	f->ctx.exc = e == ENoError ? EArgumentInvalid : e;
+	f->ctx.file = file;
+	f->ctx.func = func;
+	f->ctx.line = line;
+	ex_future_publish(f);
+}
+
+/* PROMISE_FAIL(F, E) fails F with E, capturing the current source location */
+#define PROMISE_FAIL(F, E) ex_promise_fail((F), (exc_type)(E), __FILE__, __func__, __LINE__)
+
+static inline int ex_future_ready(ex_future *f) {
+	return atomic_load_explicit(&f->state, memory_order_acquire) == EX_FUTURE_READY;
+}
+
+/* block until f is resolved, then store its value in *v or return its exception */
+static inline exc_type ex_future_wait(ex_future *f, ex_value *v) {
+	int s = atomic_load_explicit(&f->state, memory_order_acquire);
+	while (s != EX_FUTURE_READY) {
+		if (s == EX_FUTURE_WAITING || atomic_compare_exchange_weak_explicit(&f->state, &s, EX_FUTURE_WAITING, memory_order_acquire, memory_order_acquire))
+			ex_futex_wait(&f->state, EX_FUTURE_WAITING);
+		s = atomic_load_explicit(&f->state, memory_order_acquire);
+	}
+	if (f->ctx.exc == ENoError) *v = f->value;
+	return f->ctx.exc;
+}
+
+/* AWAIT(F, V) waits for F, storing its value in V or raising its exception */
+#define AWAIT(F, V) ERROR(ex_future_wait((F), &(V)))
+
+#endif /*__LIBEX_FUTURE__*/
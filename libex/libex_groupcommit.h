@@ -0,0 +1,120 @@
+/*
+ * Group commit: one fdatasync shared by every thread waiting on it.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * ex_group_commit gc;
+ * ex_group_commit_init(&gc, log_fd);
+ *
+ * any number of threads:
+ * TRY() {
+ *     ERROR(append_record(log_fd, rec))
+ *     ERROR(ex_group_commit_sync(&gc))
+ * } IN {
+ *     ... rec is durable
+ * } HANDLE CATCH (EIOError) {
+ *     ... the sync covering rec failed
+ * } FINALLY {
+ * }
+ *
+ * ex_group_commit_sync returns once a sync that started after it was called
+ * has finished, and raises that sync's error, so ENoSpaceOnDevice or EIOError
+ * reaches every thread whose data it covered. The first caller to find no
+ * sync in flight issues it for everyone queued so far, while the others
+ * block on a futex, and callers arriving during a sync wait for the next one,
+ * which one of them leads. Under load, n committers then cost about two
+ * fdatasyncs instead of n.
+ */
+
+#ifndef __LIBEX_GROUPCOMMIT__
+#define __LIBEX_GROUPCOMMIT__
+
+#include "libex.h"
+#include "libex_future.h"
+#include <stdint.h>
+#include <pthread.h>
+
+/* a thread waiting in ex_group_commit_sync */
+typedef struct ex_commit_waiter {
+	uint64_t need;		/* the sync that covers it */
+	exc_type result;
+	int done;
+	struct ex_commit_waiter *next;
+} ex_commit_waiter;
+
+typedef struct ex_group_commit {
+	int fd;
+	pthread_mutex_t lock;
+	int active;		/* a sync is in flight */
+	uint64_t completed;	/* syncs finished */
+	ex_commit_waiter *waiters;
+	atomic_int wake;	/* futex word, bumped after every sync */
+} ex_group_commit;
+
+static inline void ex_group_commit_init(ex_group_commit *gc, int fd) {
+	gc->fd = fd;
+	pthread_mutex_init(&gc->lock, NULL);
+	gc->active = 0;
+	gc->completed = 0;
+	gc->waiters = NULL;
+	atomic_init(&gc->wake, 0);
+}
+
+static inline void ex_group_commit_destroy(ex_group_commit *gc) {
+	pthread_mutex_destroy(&gc->lock);
+}
+
+/* issue the next sync, with the lock held on entry and exit, and hand its
+ * result to every waiter it covers */
+static inline void ex_group_commit_lead(ex_group_commit *gc) {
+	uint64_t g = gc->completed + 1;
+	exc_type r;
+	ex_commit_waiter **w = &gc->waiters;
+	gc->active = 1;
+	pthread_mutex_unlock(&gc->lock);
+	r = fdatasync(gc->fd) == 0 ? ENoError : (exc_type)errno;
+	pthread_mutex_lock(&gc->lock);
+	gc->completed = g;
+	gc->active = 0;
+	while (*w != NULL) {
+		if ((*w)->need <= g) {
+			(*w)->result = r;
+			(*w)->done = 1;
+			*w = (*w)->next;
+		} else {
+			w = &(*w)->next;
+		}
+	}
+	atomic_fetch_add_explicit(&gc->wake, 1, memory_order_release);
+	ex_futex_wake(&gc->wake, INT_MAX);
+}
+
+/* wait until everything written to the file before the call is durable */
+static inline exc_type ex_group_commit_sync(ex_group_commit *gc) {
+	THROWS(EIOError, ENoSpaceOnDevice, ...)
+	ex_commit_waiter self;
+	pthread_mutex_lock(&gc->lock);
+	/* a sync already in flight may have started before our write */
+	self.need = gc->completed + (gc->active ? 2 : 1);
+	self.done = 0;
+	self.result = ENoError;
+	self.next = gc->waiters;
+	gc->waiters = &self;
+	while (!self.done) {
+		if (!gc->active) {
+			ex_group_commit_lead(gc);
+		} else {
+			int seen = atomic_load_explicit(&gc->wake, memory_order_acquire);
+			pthread_mutex_unlock(&gc->lock);
+			ex_futex_wait(&gc->wake, seen);
+			pthread_mutex_lock(&gc->lock);
+		}
+	}
+	pthread_mutex_unlock(&gc->lock);
+	ERROR(self.result);
+	DONE;
+}
+
+#endif /*__LIBEX_GROUPCOMMIT__*/
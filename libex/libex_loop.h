@@ -0,0 +1,175 @@
+/*
+ * An edge-triggered epoll loop that resumes operations which would block.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * static exc_type echo(ex_loop *loop, ex_watch *w) {
+ *     THROWS(...)
+ *     conn *c = (conn*)w->data;
+ *     TRY() {
+ *         ERROR(echo_some(w->fd, c))
+ *     } IN {
+ *     } HANDLE CATCH (EWouldBlock) {
+ *         WAIT_READY(w, c->unsent ? EX_WRITABLE : EX_READABLE);
+ *     } CATCHANY {
+ *         RETHROW;
+ *     } FINALLY {
+ *     }
+ *     DONE;
+ * }
+ *
+ * static void hang_up(ex_loop *loop, ex_watch *w, exc_type e) {
+ *     close(w->fd);
+ *     free(w->data);
+ * }
+ *
+ * ex_watch_init(&c->watch, fd, echo, hang_up, c);
+ * ERROR(ex_loop_add(&loop, &c->watch))
+ * ...
+ * ERROR(ex_loop_run(&loop))
+ *
+ * On a non-blocking descriptor, EWouldBlock is the normal case rather than a
+ * failure. A watch pairs a descriptor with an operation, its run function,
+ * which the loop calls whenever the descriptor may have made progress. The
+ * operation does as much as it can, and when it meets EWouldBlock it names
+ * what it is waiting for with WAIT_READY, which rethrows so that run returns
+ * EWouldBlock. The loop then parks the watch, and calls run again once
+ * epoll reports the descriptor readable or writable as asked, so nobody
+ * re-arms anything by hand: every descriptor is registered once, for both
+ * directions, edge-triggered, and the loop remembers readiness it was not
+ * yet waiting for.
+ *
+ * run returning anything other than EWouldBlock completes the operation:
+ * the loop removes the descriptor and calls the watch's close function with
+ * the result, ENoError or the exception, and only then. Locals of run do not
+ * survive a suspension, so whatever the operation holds until it completes,
+ * buffers, descriptors, half-written replies, belongs in w->data, and close
+ * releases it. A watch may only be closed by its own run returning, and
+ * close may free it. Linux only.
+ */
+
+#ifndef __LIBEX_LOOP__
+#define __LIBEX_LOOP__
+
+#include "libex.h"
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#ifndef LIBEX_LOOP_EVENTS
+#define LIBEX_LOOP_EVENTS 64
+#endif
+
+#define EX_READABLE EPOLLIN
+#define EX_WRITABLE EPOLLOUT
+
+typedef struct ex_loop {
+	int epfd;
+	int stop;		/* set by ex_loop_stop, to return from ex_loop_run */
+	size_t live;		/* watches added and not yet closed */
+} ex_loop;
+
+typedef struct ex_watch ex_watch;
+typedef exc_type (*ex_watch_run)(ex_loop *loop, ex_watch *w);
+typedef void (*ex_watch_close)(ex_loop *loop, ex_watch *w, exc_type e);
+
+struct ex_watch {
+	int fd;
+	unsigned want;		/* readiness run is waiting for */
+	unsigned ready;		/* readiness seen and not yet used up */
+	ex_watch_run run;
+	ex_watch_close close;
+	void *data;
+};
+
+static inline exc_type ex_loop_init(ex_loop *loop) {
+	THROWS(EOutOfMemory, ...)
+	loop->stop = 0;
+	loop->live = 0;
+	ERRORE_UNPOLLED(-1 == (loop->epfd = epoll_create1(EPOLL_CLOEXEC)), errno);
+	DONE;
+}
+
+/* close the loop; watches still added are left to their owners */
+static inline void ex_loop_destroy(ex_loop *loop) {
+	close(loop->epfd);
+}
+
+/* make ex_loop_run return once the events already received are handled */
+static inline void ex_loop_stop(ex_loop *loop) {
+	loop->stop = 1;
+}
+
+static inline void ex_watch_init(ex_watch *w, int fd, ex_watch_run run, ex_watch_close close, void *data) {
+	w->fd = fd;
+	w->want = EX_READABLE | EX_WRITABLE;
+	w->ready = 0;
+	w->run = run;
+	w->close = close;
+	w->data = data;
+}
+
+/* park w until its descriptor is ready for events, which readiness it had
+ * before the EWouldBlock no longer counts towards */
+static inline void ex_watch_wait(ex_watch *w, unsigned events) {
+	w->want = events;
+	w->ready &= ~events;
+}
+
+/* WAIT_READY(W, EVENTS) goes in a CATCH (EWouldBlock) handler of a watch's run
+ * function, and resumes the operation once W is ready for EVENTS */
+#define WAIT_READY(W, EVENTS) { ex_watch_wait((W), (EVENTS)); RETHROW; }
+
+/* run w's operation, which uses up the readiness it was waiting for, and
+ * remove and close w if it completes */
+static inline void ex_loop_resume(ex_loop *loop, ex_watch *w) {
+	exc_type e;
+	w->ready &= ~w->want;
+	e = w->run(loop, w);
+	if (e != EWouldBlock) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+		--loop->live;
+		w->close(loop, w, e);
+	}
+}
+
+/* register w's descriptor, and start its operation once it is ready */
+static inline exc_type ex_loop_add(ex_loop *loop, ex_watch *w) {
+	THROWS(EOutOfMemory, ...)
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = w;
+	/* once added, epoll holds w, so nothing polls until it is counted */
+	ERRORE_UNPOLLED(0 != epoll_ctl(loop->epfd, EPOLL_CTL_ADD, w->fd, &ev), errno);
+	++loop->live;
+	DONE;
+}
+
+/* dispatch readiness to the watches until ex_loop_stop is called or none
+ * are left */
+static inline exc_type ex_loop_run(ex_loop *loop) {
+	THROWS(...)
+	struct epoll_event evs[LIBEX_LOOP_EVENTS];
+	loop->stop = 0;
+	while (!loop->stop && loop->live > 0) {
+		int n = epoll_wait(loop->epfd, evs, LIBEX_LOOP_EVENTS, -1), i;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			THROW(errno)
+		}
+		for (i = 0; i < n; ++i) {
+			ex_watch *w = (ex_watch*)evs[i].data.ptr;
+			unsigned ready = evs[i].events & (EX_READABLE | EX_WRITABLE);
+			/* errors and hang-ups are found by trying the operation */
+			if (evs[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) ready = EX_READABLE | EX_WRITABLE;
+			w->ready |= ready;
+			if (w->ready & w->want) ex_loop_resume(loop, w);
+		}
+		CANCELPOINT
+	}
+	THROWONERROR;
+	DONE;
+}
+
+#endif /*__LIBEX_LOOP__*/
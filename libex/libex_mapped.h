@@ -0,0 +1,89 @@
+/*
+ * Memory-mapped files that raise EIOError instead of dying of SIGBUS.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * const char *data;
+ * size_t len;
+ * TRY_MAPPED(data, len, "/var/lib/app/index.dat", ) {
+ * } IN {
+ *     ... scan data[0] to data[len - 1] in place
+ * } HANDLE CATCH (EIOError) {
+ *     ... the file shrank, or its storage failed, during the scan
+ * } FINALLY {
+ * }
+ *
+ * TRY_MAPPED maps the whole file read-only into the existing pointer P and
+ * size_t LEN, and unmaps it when the block exits. Reading a page of a mapped
+ * file that has since been truncated, or whose backing store fails, is a
+ * SIGBUS rather than an error return. Inside the block, any SIGBUS or SIGSEGV
+ * at an address in the mapping instead abandons the TRY or IN scope and
+ * raises EIOError in the block, whose handlers then see it just as though
+ * opening the file had failed. So a mapping is as safe to scan as read()
+ * is, without the copy.
+ *
+ * The recovery is a siglongjmp, and the limits in libex_signal.h apply: code
+ * scanning the mapping should not itself open blocks that own resources, and
+ * locals it modifies that are read after a fault must be volatile. An empty
+ * file binds P to NULL and LEN to 0. POSIX only.
+ */
+
+#ifndef __LIBEX_MAPPED__
+#define __LIBEX_MAPPED__
+
+#include "libex.h"
+#include "libex_signal.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* map the file at path read-only, and guard the mapping */
+static inline exc_type ex_mapped_open(ex_signal_guard *g, const char *path) {
+	THROWS(...)
+	int fd;
+	struct stat st;
+	void *base = NULL;
+	ERROR(ex_signal_install());
+	/* nothing polls once the file is open, so neither the descriptor nor
+	 * the mapping can be left behind */
+	ERRORE_UNPOLLED(-1 == (fd = open(path, O_RDONLY | O_CLOEXEC)), errno);
+	if (0 != fstat(fd, &st)) {
+		THROWS = (exc_type)errno;
+	} else if ((uint64_t)st.st_size > SIZE_MAX) {
+		THROWS = EFileTooBig;
+	} else if (st.st_size > 0 && MAP_FAILED == (base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0))) {
+		THROWS = (exc_type)errno;
+	}
+	close(fd);
+	THROWONERROR_UNPOLLED;
+	ex_signal_push(g, base, (size_t)st.st_size, EIOError, ENoError);
+	DONE;
+}
+
+/* stop guarding the mapping and unmap it, if it was opened, returning e */
+static inline exc_type ex_mapped_close(ex_signal_guard *g, exc_type e) {
+	if (ex_signal_top != g) return e;
+	ex_signal_pop(g);
+	if (g->base != NULL) munmap(g->base, g->size);
+	return e;
+}
+
+/* TRY_MAPPED(P, LEN, PATH, D) is TRY(D), but first maps the file at PATH into
+ * P and LEN, raises EIOError in the block for a fault while reading it, and
+ * unmaps it when the block exits */
+#define TRY_MAPPED(P, LEN, PATH, D) TRY_WITH(ex_signal_guard __ex_mapped, \
+	if (ENoError == (THROWS = ex_mapped_open(&__ex_mapped, (PATH)))) { \
+		if (sigsetjmp(__ex_mapped.env, 0)) { \
+			THROWS = __ex_mapped.raised; \
+		} else { \
+			(P) = (void*)__ex_mapped.base; \
+			(LEN) = __ex_mapped.size; \
+		} \
+	}, \
+	THROWS = ex_mapped_close(&__ex_mapped, THROWS), D)
+
+#endif /*__LIBEX_MAPPED__*/
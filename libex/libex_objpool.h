@@ -0,0 +1,228 @@
+/*
+ * Object pools with checkout scoped to exception blocks.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * ex_objpool conns;
+ * ERROR(ex_objpool_init(&conns, 64, connect_fn, disconnect_fn, &server))
+ *
+ * conn *c;
+ * TRY_POOL(c, &conns, ) {
+ *     ERROR(send_request(c, req))
+ * } IN {
+ *     ...
+ * } HANDLE CATCH (EConnectionReset) {
+ *     POOL_DISCARD;
+ * } FINALLY {
+ * }
+ *
+ * TRY_POOL checks an object out of the pool before the TRY scope, raising
+ * EResourceUnavailable if all of the pool's objects are in use, and returns
+ * it to the pool when the block exits, on every path. POOL_DISCARD, anywhere
+ * in the block, destroys the object instead, for objects left in a state
+ * that should not be reused; a later checkout creates a replacement.
+ *
+ * Objects are created on demand up to the pool's maximum. If create fails
+ * after storing an object, the pool destroys it. Returned objects go
+ * to a small per-thread cache first, which needs no synchronisation, and only
+ * spill to the shared list under the pool lock when the cache is full, half
+ * of it at a time. Idle objects in one thread's cache are not visible to
+ * other threads, so a thread should call ex_objpool_flush() before it exits,
+ * and a pool may report exhaustion while up to LIBEX_POOL_CACHE objects per
+ * thread sit idle.
+ */
+
+#ifndef __LIBEX_OBJPOOL__
+#define __LIBEX_OBJPOOL__
+
+#include "libex.h"
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* idle objects each thread keeps per pool */
+#ifndef LIBEX_POOL_CACHE
+#define LIBEX_POOL_CACHE 8
+#endif
+
+/* pools each thread keeps a cache for */
+#ifndef LIBEX_POOL_CACHES
+#define LIBEX_POOL_CACHES 4
+#endif
+
+typedef exc_type (*ex_objpool_create_fn)(void *ctx, void **obj);
+typedef void (*ex_objpool_destroy_fn)(void *ctx, void *obj);
+
+typedef struct ex_objpool {
+	ex_objpool_create_fn create;
+	ex_objpool_destroy_fn destroy;
+	void *ctx;
+	unsigned id;		/* tells apart pools reusing an address */
+	pthread_mutex_t lock;
+	size_t max, live;	/* live counts objects in or out of the pool, under the lock */
+	void **idle;		/* shared overflow stack of max entries, under the lock */
+	size_t nidle;
+} ex_objpool;
+
+typedef struct ex_objpool_cache {
+	ex_objpool *pool;
+	unsigned id;
+	unsigned n;
+	void *objs[LIBEX_POOL_CACHE];
+} ex_objpool_cache;
+
+LIBEX_SHARED atomic_uint ex_objpool_ids = 0;
+
+LIBEX_SHARED LIBEX_TLS ex_objpool_cache ex_objpool_tls[LIBEX_POOL_CACHES];
+
+static inline exc_type ex_objpool_init(ex_objpool *p, size_t max, ex_objpool_create_fn create, ex_objpool_destroy_fn destroy, void *ctx) {
+	THROWS(EOutOfMemory)
+	p->create = create;
+	p->destroy = destroy;
+	p->ctx = ctx;
+	p->id = atomic_fetch_add(&ex_objpool_ids, 1) + 1;
+	p->max = max;
+	p->live = 0;
+	p->nidle = 0;
+	/* nothing releases the list if this raises later, so do not poll */
+	MAYBE_UNPOLLED(p->idle = (void**)malloc((max ? max : 1) * sizeof(void*)), EOutOfMemory);
+	pthread_mutex_init(&p->lock, NULL);
+	DONE;
+}
+
+/* the calling thread's cache for p, claiming an empty one if it has none,
+ * or NULL if every cache is in use for another pool */
+static inline ex_objpool_cache *ex_objpool_cache_for(ex_objpool *p) {
+	ex_objpool_cache *empty = NULL;
+	int i;
+	for (i = 0; i < LIBEX_POOL_CACHES; ++i) {
+		ex_objpool_cache *c = &ex_objpool_tls[i];
+		if (c->pool == p && c->id == p->id) return c;
+		if (c->n == 0 && empty == NULL) empty = c;
+	}
+	if (empty != NULL) {
+		empty->pool = p;
+		empty->id = p->id;
+	}
+	return empty;
+}
+
+/* move n objects from the cache to the shared list, under the lock */
+static inline void ex_objpool_spill(ex_objpool *p, ex_objpool_cache *c, unsigned n) {
+	while (n-- > 0) p->idle[p->nidle++] = c->objs[--c->n];
+}
+
+/* check out an object, creating one if none is idle and the pool is not full */
+static inline exc_type ex_objpool_get(ex_objpool *p, void **obj) {
+	THROWS(EResourceUnavailable, ...)
+	ex_objpool_cache *c = ex_objpool_cache_for(p);
+	int found = 0, create = 0;
+	if (c != NULL && c->n != 0) {
+		*obj = c->objs[--c->n];
+		RETURN;
+	}
+	pthread_mutex_lock(&p->lock);
+	if (p->nidle != 0) {
+		*obj = p->idle[--p->nidle];
+		found = 1;
+	} else if (p->live < p->max) {
+		++p->live;
+		create = 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (found) RETURN;
+	ERRORE_UNPOLLED(!create, EResourceUnavailable);
+	/* the slot counted in live is ours until the object reaches the caller,
+	 * so nothing from here on polls */
+	*obj = NULL;
+	THROWS = p->create(p->ctx, obj);
+	if (THROWS != ENoError) {
+		if (*obj != NULL) p->destroy(p->ctx, *obj);
+		*obj = NULL;
+		pthread_mutex_lock(&p->lock);
+		--p->live;
+		pthread_mutex_unlock(&p->lock);
+	}
+	THROWONERROR_UNPOLLED;
+	DONE;
+}
+
+/* return an object to the pool */
+static inline void ex_objpool_put(ex_objpool *p, void *obj) {
+	ex_objpool_cache *c = ex_objpool_cache_for(p);
+	if (c != NULL && c->n < LIBEX_POOL_CACHE) {
+		c->objs[c->n++] = obj;
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	if (c != NULL) ex_objpool_spill(p, c, LIBEX_POOL_CACHE / 2);
+	p->idle[p->nidle++] = obj;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* destroy a checked out object instead of returning it */
+static inline void ex_objpool_discard(ex_objpool *p, void *obj) {
+	p->destroy(p->ctx, obj);
+	pthread_mutex_lock(&p->lock);
+	--p->live;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* move the calling thread's idle objects to the shared list */
+static inline void ex_objpool_flush(ex_objpool *p) {
+	int i;
+	for (i = 0; i < LIBEX_POOL_CACHES; ++i) {
+		ex_objpool_cache *c = &ex_objpool_tls[i];
+		if (c->pool != p || c->id != p->id) continue;
+		pthread_mutex_lock(&p->lock);
+		ex_objpool_spill(p, c, c->n);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+/* destroy every idle object, once all are returned and other threads have
+ * flushed their caches */
+static inline void ex_objpool_destroy(ex_objpool *p) {
+	ex_objpool_flush(p);
+	while (p->nidle != 0) p->destroy(p->ctx, p->idle[--p->nidle]);
+	p->live = 0;
+	free(p->idle);
+	p->idle = NULL;
+	pthread_mutex_destroy(&p->lock);
+}
+
+/* a checkout held by a TRY_POOL block */
+typedef struct ex_objpool_lease {
+	ex_objpool *pool;
+	void *obj;
+	int discard;
+} ex_objpool_lease;
+
+static inline exc_type ex_objpool_lease_get(ex_objpool_lease *l, ex_objpool *p) {
+	l->pool = p;
+	l->obj = NULL;
+	l->discard = 0;
+	return ex_objpool_get(p, &l->obj);
+}
+
+static inline void ex_objpool_lease_end(ex_objpool_lease *l) {
+	if (l->obj == NULL) return;
+	if (l->discard) {
+		ex_objpool_discard(l->pool, l->obj);
+	} else {
+		ex_objpool_put(l->pool, l->obj);
+	}
+}
+
+/* TRY_POOL(OBJ, POOL, D) is TRY(D), but first checks an object out of POOL
+ * into the existing pointer OBJ, and returns it when the block exits */
+#define TRY_POOL(OBJ, POOL, D) TRY_WITH(ex_objpool_lease __ex_lease, \
+	if (ENoError == (THROWS = ex_objpool_lease_get(&__ex_lease, (POOL)))) (OBJ) = __ex_lease.obj, \
+	ex_objpool_lease_end(&__ex_lease), D)
+
+/* POOL_DISCARD destroys the enclosing TRY_POOL's object when the block
+ * exits, instead of returning it to the pool */
+#define POOL_DISCARD (__ex_lease.discard = 1)
+
+#endif /*__LIBEX_OBJPOOL__*/
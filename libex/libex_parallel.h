@@ -0,0 +1,239 @@
+/*
+ * Data-parallel loops over libex-style bodies.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * static exc_type scale(void *ctx, size_t begin, size_t end) {
+ *     THROWS(EOverflow)
+ *     ... process elements [begin, end), raising as usual
+ *     DONE;
+ * }
+ *
+ * ex_pool pool;
+ * TRY() {
+ *     ERROR(ex_pool_init(&pool, 8))
+ * } IN {
+ *     ERROR(ex_parallel_for(&pool, n, 1024, scale, data))
+ * } HANDLE CATCH (EOverflow) {
+ *     ... some chunk overflowed
+ * } FINALLY {
+ *     ex_pool_destroy(&pool);
+ * }
+ *
+ * The index space [0, n) is split into chunks of grain elements, which the
+ * pool's threads and the calling thread claim in increasing order. The first
+ * chunk to fail stops every chunk after it from starting, and when compiled
+ * with LIBEX_CANCEL, also cancels those already running at their next check
+ * point. Chunks before the failing one always run to completion, so the error
+ * returned is that of the lowest-index failing chunk, independent of
+ * scheduling. Bodies always return normally, so every started chunk runs its
+ * FINALLY blocks.
+ *
+ * While a body runs, ex_parallel_slot is the index of the thread running it,
+ * 0 for the caller and below the pool's nthreads otherwise, so a body can
+ * keep scratch state per thread in an array of nthreads entries rather than
+ * setting it up for every chunk.
+ */
+
+#ifndef __LIBEX_PARALLEL__
+#define __LIBEX_PARALLEL__
+
+#include "libex.h"
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* a loop body processing the elements [begin, end) */
+typedef exc_type (*ex_body)(void *ctx, size_t begin, size_t end);
+
+#define EX_CHUNK_IDLE SIZE_MAX
+
+/* one per thread taking part in a loop, the calling thread being slot 0 */
+typedef struct ex_pool_slot {
+	struct ex_pool *pool;
+	pthread_t thread;
+	atomic_size_t chunk;	/* chunk being run, or EX_CHUNK_IDLE */
+#ifdef LIBEX_CANCEL
+	ex_cancel_token tok;
+#endif
+} ex_pool_slot;
+
+typedef struct ex_job {
+	ex_body body;
+	void *ctx;
+	size_t n, grain, nchunks;
+	atomic_size_t next;	/* next chunk to claim */
+	atomic_size_t failed;	/* lowest failing chunk, or nchunks */
+	exc_type error;		/* error of the failed chunk, under the pool lock */
+	size_t active;		/* pool threads still running, under the pool lock */
+} ex_job;
+
+typedef struct ex_pool {
+	ex_pool_slot *slots;
+	size_t nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t wake, idle;
+	ex_job *job;
+	unsigned generation;
+	int stop;
+} ex_pool;
+
+/* record that chunk c failed with e, and cancel the running chunks after it */
+static inline void ex_job_fail(ex_pool *p, ex_job *job, size_t c, exc_type e) {
+	pthread_mutex_lock(&p->lock);
+	if (c < atomic_load(&job->failed)) {
+#ifdef LIBEX_CANCEL
+		size_t i;
+#endif
+		atomic_store(&job->failed, c);
+		job->error = e;
+#ifdef LIBEX_CANCEL
+		for (i = 0; i < p->nthreads; ++i) {
+			size_t running = atomic_load(&p->slots[i].chunk);
+			if (running != EX_CHUNK_IDLE && running > c) ex_cancel(&p->slots[i].tok);
+		}
+#endif
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* the slot of the thread running the current chunk */
+LIBEX_SHARED LIBEX_TLS size_t ex_parallel_slot = 0;
+
+/* claim and run chunks until none are left or a lower chunk has failed */
+static inline void ex_job_run(ex_pool *p, ex_job *job, ex_pool_slot *slot) {
+	/* a body may run a loop of its own, on another pool */
+	size_t outer = ex_parallel_slot;
+	ex_parallel_slot = (size_t)(slot - p->slots);
+	for (;;) {
+		size_t c = atomic_fetch_add(&job->next, 1);
+		size_t end;
+		exc_type e;
+		if (c >= job->nchunks || c > atomic_load(&job->failed)) break;
+#ifdef LIBEX_CANCEL
+		ex_cancel_reset(&slot->tok);
+#endif
+		atomic_store(&slot->chunk, c);
+		/* a failure recorded before the store above did not see this chunk */
+		if (c > atomic_load(&job->failed)) break;
+		end = c * job->grain + job->grain;
+		if (end > job->n) end = job->n;
+		{
+#ifdef LIBEX_CANCEL
+			/* each chunk polls its slot's token, from its own block */
+			ex_cancel_token *saved = ex_cancel_push(&slot->tok);
+#endif
+			e = job->body(job->ctx, c * job->grain, end);
+#ifdef LIBEX_CANCEL
+			ex_cancel_pop(saved, e);
+#endif
+		}
+		atomic_store(&slot->chunk, EX_CHUNK_IDLE);
+		if (e != ENoError) ex_job_fail(p, job, c, e);
+	}
+	atomic_store(&slot->chunk, EX_CHUNK_IDLE);
+	ex_parallel_slot = outer;
+}
+
+static inline void *ex_pool_worker(void *arg) {
+	ex_pool_slot *slot = (ex_pool_slot*)arg;
+	ex_pool *p = slot->pool;
+	unsigned seen = 0;
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->stop && p->generation == seen) pthread_cond_wait(&p->wake, &p->lock);
+		if (p->stop) break;
+		seen = p->generation;
+		pthread_mutex_unlock(&p->lock);
+		ex_job_run(p, p->job, slot);
+		pthread_mutex_lock(&p->lock);
+		if (--p->job->active == 0) pthread_cond_signal(&p->idle);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* stop and join the pool's threads; safe on a partially initialised pool */
+static inline void ex_pool_destroy(ex_pool *p) {
+	size_t i;
+	if (p->slots == NULL) return;
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 1; i < p->nthreads; ++i) pthread_join(p->slots[i].thread, NULL);
+	pthread_cond_destroy(&p->idle);
+	pthread_cond_destroy(&p->wake);
+	pthread_mutex_destroy(&p->lock);
+	free(p->slots);
+	p->slots = NULL;
+}
+
+/* start a pool of nthreads threads, counting the calling thread */
+static inline exc_type ex_pool_init(ex_pool *p, size_t nthreads) {
+	THROWS(EOutOfMemory, EResourceUnavailable)
+	size_t i;
+	if (nthreads == 0) nthreads = 1;
+	p->slots = NULL;
+	p->nthreads = 1;
+	p->job = NULL;
+	p->generation = 0;
+	p->stop = 0;
+	TRY() {
+		/* nothing polls from here, so the handler only ever sees a pool
+		 * whose lock is initialized and whose threads are all counted */
+		MAYBE_UNPOLLED(p->slots = (ex_pool_slot*)calloc(nthreads, sizeof(ex_pool_slot)), EOutOfMemory);
+		pthread_mutex_init(&p->lock, NULL);
+		pthread_cond_init(&p->wake, NULL);
+		pthread_cond_init(&p->idle, NULL);
+		for (i = 0; i < nthreads; ++i) {
+			p->slots[i].pool = p;
+			atomic_init(&p->slots[i].chunk, EX_CHUNK_IDLE);
+		}
+		/* a failure only exits the loop, and is rethrown after it */
+		for (i = 1; i < nthreads; ++i) {
+			ERROR_UNPOLLED(pthread_create(&p->slots[i].thread, NULL, ex_pool_worker, &p->slots[i]));
+			p->nthreads = i + 1;
+		}
+		THROWONERROR_UNPOLLED;
+	} IN {
+	} HANDLE CATCHANY {
+		ex_pool_destroy(p);
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+/* run body over [0, n) in chunks of grain elements, returning the error of
+ * the lowest-index failing chunk */
+static inline exc_type ex_parallel_for(ex_pool *p, size_t n, size_t grain, ex_body body, void *ctx) {
+	THROWS(...)
+	ex_job job;
+	if (grain == 0) grain = 1;
+	job.body = body;
+	job.ctx = ctx;
+	job.n = n;
+	job.grain = grain;
+	job.nchunks = n / grain + (n % grain != 0);
+	job.error = ENoError;
+	job.active = p->nthreads - 1;
+	atomic_init(&job.next, 0);
+	atomic_init(&job.failed, job.nchunks);
+	pthread_mutex_lock(&p->lock);
+	p->job = &job;
+	++p->generation;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	ex_job_run(p, &job, &p->slots[0]);
+	pthread_mutex_lock(&p->lock);
+	while (job.active != 0) pthread_cond_wait(&p->idle, &p->lock);
+	p->job = NULL;
+	pthread_mutex_unlock(&p->lock);
+	ERROR(job.error);
+	DONE;
+}
+
+#endif /*__LIBEX_PARALLEL__*/
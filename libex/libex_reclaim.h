@@ -0,0 +1,111 @@
+/*
+ * Reclaiming memory from caches before EOutOfMemory propagates.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * static size_t shrink_page_cache(void *ctx, size_t want) {
+ *     ... drop cached pages until want bytes are freed, return how many were
+ * }
+ *
+ * at startup:
+ * ERROR(ex_reclaim_register(shrink_page_cache, &pages, 10))
+ *
+ * TRY(char *buf) {
+ *     MAYBE_RECLAIM(buf = (char*)malloc(n), n)
+ * } IN {
+ *     ...
+ *
+ * MAYBE_RECLAIM is MAYBE(E, EOutOfMemory), except that when E yields NULL it
+ * runs the registered reclaimers in priority order, lowest first, retrying E
+ * after each one that freed something, and only raises EOutOfMemory once
+ * they are exhausted. Handlers can reclaim too, with ex_reclaim():
+ *
+ * } HANDLE CATCH (EOutOfMemory) {
+ *     if (ex_reclaim(0) == 0) RETHROW;
+ *     ... retry
+ *
+ * Reclaimers are registered once at startup, before other threads run, and
+ * may be called from any thread that fails an allocation, so must do their
+ * own locking. A reclaimer that itself runs out of memory does not recurse:
+ * nested reclaims on the same thread find nothing to reclaim.
+ */
+
+#ifndef __LIBEX_RECLAIM__
+#define __LIBEX_RECLAIM__
+
+#include "libex.h"
+
+#ifndef LIBEX_RECLAIMERS
+#define LIBEX_RECLAIMERS 16
+#endif
+
+/* release memory, ideally at least want bytes, returning how much was freed */
+typedef size_t (*ex_reclaimer)(void *ctx, size_t want);
+
+typedef struct ex_reclaim_hook {
+	ex_reclaimer fn;
+	void *ctx;
+	int priority;
+} ex_reclaim_hook;
+
+/* the registered reclaimers, in increasing order of priority */
+LIBEX_SHARED ex_reclaim_hook ex_reclaim_hooks[LIBEX_RECLAIMERS];
+LIBEX_SHARED unsigned ex_reclaim_count = 0;
+
+/* set while the current thread is running reclaimers */
+LIBEX_SHARED LIBEX_TLS int ex_reclaiming = 0;
+
+/* register fn to run after every reclaimer of a lower priority number, and
+ * after those of the same priority registered before it */
+static inline exc_type ex_reclaim_register(ex_reclaimer fn, void *ctx, int priority) {
+	THROWS(EBufferUnavailable)
+	unsigned i;
+	ERRORE(ex_reclaim_count == LIBEX_RECLAIMERS, EBufferUnavailable);
+	for (i = ex_reclaim_count; i > 0 && ex_reclaim_hooks[i - 1].priority > priority; --i) {
+		ex_reclaim_hooks[i] = ex_reclaim_hooks[i - 1];
+	}
+	ex_reclaim_hooks[i].fn = fn;
+	ex_reclaim_hooks[i].ctx = ctx;
+	ex_reclaim_hooks[i].priority = priority;
+	++ex_reclaim_count;
+	DONE;
+}
+
+/* run the reclaimers from *next on until one frees something, returning how
+ * much it freed, or 0 once they are exhausted */
+static inline size_t ex_reclaim_step(unsigned *next, size_t want) {
+	size_t freed = 0;
+	if (ex_reclaiming) return 0;
+	ex_reclaiming = 1;
+	while (freed == 0 && *next < ex_reclaim_count) {
+		ex_reclaim_hook *h = &ex_reclaim_hooks[(*next)++];
+		freed = h->fn(h->ctx, want);
+	}
+	ex_reclaiming = 0;
+	return freed;
+}
+
+/* run reclaimers in priority order until want bytes have been freed, or all
+ * of them if want is 0, returning the total freed */
+static inline size_t ex_reclaim(size_t want) {
+	unsigned next = 0;
+	size_t total = 0, freed;
+	while ((want == 0 || total < want) && (freed = ex_reclaim_step(&next, want == 0 ? SIZE_MAX : want - total)) != 0) {
+		total += freed;
+	}
+	return total;
+}
+
+/* MAYBE_RECLAIM(E, N) evaluates the allocation E, which needs N bytes, and
+ * while it yields NULL, reclaims memory and evaluates it again, raising
+ * EOutOfMemory once nothing more can be reclaimed */
+#define MAYBE_RECLAIM(E, N) { \
+	unsigned __ex_hook = 0; \
+	while (NULL == (E)) { \
+		if (ex_reclaim_step(&__ex_hook, (N)) == 0) { THROWS = EOutOfMemory; break; } \
+	} } \
+	THROWONERROR;
+
+#endif /*__LIBEX_RECLAIM__*/
@@ -0,0 +1,139 @@
+/*
+ * An emergency memory reserve for handling EOutOfMemory.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * at startup:
+ * ERROR(ex_reserve_init(64 * 1024))
+ *
+ * TRY(char *buf) {
+ *     MAYBE(buf = (char*)malloc(n), EOutOfMemory)
+ * } IN {
+ *     ...
+ * } HANDLE CATCH (EOutOfMemory) {
+ *     char *msg = (char*)HANDLER_ALLOC(256);
+ *     ... format and log msg
+ *     HANDLER_FREE(msg);
+ *     RETHROW;
+ * } FINALLY {
+ * }
+ *
+ * The reserve is mapped and faulted in up front, so drawing on it can not
+ * fail for lack of memory. HANDLER_ALLOC only draws on it while the exception
+ * being handled is EOutOfMemory, falling back to malloc when the reserve is
+ * exhausted, and uses plain malloc otherwise, so ordinary errors never eat
+ * into it. HANDLER_FREE releases memory from either source.
+ *
+ * The reserve is a bump allocator shared by all threads, whose offset returns
+ * to the start whenever every allocation from it has been freed, so it suits
+ * the short-lived buffers of error paths, not long-lived ones.
+ */
+
+#ifndef __LIBEX_RESERVE__
+#define __LIBEX_RESERVE__
+
+#include "libex.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define LIBEX_RESERVE_ALIGN 16
+
+LIBEX_SHARED char *ex_reserve_base = NULL;
+LIBEX_SHARED size_t ex_reserve_size = 0;
+
+/* live allocations in the high 32 bits, bytes used in the low 32 */
+LIBEX_SHARED atomic_uint_least64_t ex_reserve_state = 0;
+
+/* map and pre-fault a reserve of size bytes, which must be under 4GiB */
+static inline exc_type ex_reserve_init(size_t size) {
+	THROWS(EOutOfMemory, EArgumentInvalid)
+	char *base;
+	ERRORE(size == 0 || (uint64_t)size >= UINT32_MAX || ex_reserve_base != NULL, EArgumentInvalid);
+	/* nothing polls until the reserve is installed, or it would leak */
+#if defined(_WIN32)
+	MAYBE_UNPOLLED(base = (char*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE), EOutOfMemory);
+#else
+#ifdef MAP_POPULATE
+	base = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+#else
+	base = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+	ERRORE_UNPOLLED(base == MAP_FAILED, EOutOfMemory);
+#endif
+	/* touch every page, in case the mapping was not populated */
+	memset(base, 0, size);
+	ex_reserve_base = base;
+	ex_reserve_size = size;
+	atomic_store(&ex_reserve_state, 0);
+	DONE;
+}
+
+/* unmap the reserve, once nothing allocated from it is in use */
+static inline void ex_reserve_destroy(void) {
+	if (ex_reserve_base == NULL) return;
+#if defined(_WIN32)
+	VirtualFree(ex_reserve_base, 0, MEM_RELEASE);
+#else
+	munmap(ex_reserve_base, ex_reserve_size);
+#endif
+	ex_reserve_base = NULL;
+	ex_reserve_size = 0;
+}
+
+static inline int ex_reserve_owns(void *p) {
+	return ex_reserve_base != NULL && (char*)p >= ex_reserve_base && (char*)p < ex_reserve_base + ex_reserve_size;
+}
+
+/* allocate n bytes from the reserve, or return NULL if it is exhausted */
+static inline void *ex_reserve_alloc(size_t n) {
+	uint_least64_t s = atomic_load(&ex_reserve_state), next;
+	uint64_t at;
+	if (ex_reserve_base == NULL || n > ex_reserve_size) return NULL;
+	do {
+		at = ((s & UINT32_MAX) + (LIBEX_RESERVE_ALIGN - 1)) & ~(uint64_t)(LIBEX_RESERVE_ALIGN - 1);
+		if (at + n > ex_reserve_size) return NULL;
+		next = (((s >> 32) + 1) << 32) | (at + n);
+	} while (!atomic_compare_exchange_weak(&ex_reserve_state, &s, next));
+	return ex_reserve_base + at;
+}
+
+/* free an allocation from the reserve, rewinding it once none are live */
+static inline void ex_reserve_free(void *p) {
+	uint_least64_t s = atomic_load(&ex_reserve_state), next;
+	(void)p;
+	do {
+		next = s - ((uint_least64_t)1 << 32);
+		if ((next >> 32) == 0) next = 0;
+	} while (!atomic_compare_exchange_weak(&ex_reserve_state, &s, next));
+}
+
+/* allocate n bytes for a handler of the exception inflight */
+static inline void *ex_handler_alloc(exc_type inflight, size_t n) {
+	void *p = NULL;
+	if (inflight == EOutOfMemory) p = ex_reserve_alloc(n);
+	return p != NULL ? p : malloc(n);
+}
+
+static inline void ex_handler_free(void *p) {
+	if (ex_reserve_owns(p)) {
+		ex_reserve_free(p);
+	} else {
+		free(p);
+	}
+}
+
+/* HANDLER_ALLOC(N) allocates N bytes in a handler, from the reserve when the
+ * exception being handled is EOutOfMemory, and HANDLER_FREE(P) frees them */
+#define HANDLER_ALLOC(N) ex_handler_alloc(THROWS, (N))
+#define HANDLER_FREE(P) ex_handler_free(P)
+
+#endif /*__LIBEX_RESERVE__*/
@@ -0,0 +1,152 @@
+/*
+ * Signals raised as exceptions within guarded blocks.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * TRY_GUARDED(table, table_size, ) {
+ * } IN {
+ *     for (i = 0; i < n; ++i) out[i] = table[idx[i]] / div[i];
+ * } HANDLE CATCH (EOutOfRange) {
+ *     ... some div[i] was zero
+ * } CATCH (EBadAddress) {
+ *     ... an access to table faulted
+ * } FINALLY {
+ * }
+ *
+ * TRY_GUARDED(BASE, SIZE, D) is TRY(D), but while the block runs, a SIGFPE
+ * on the current thread raises EOutOfRange, and a SIGSEGV or SIGBUS at an
+ * address in [BASE, BASE + SIZE) raises EBadAddress. Pass NULL and 0 to guard
+ * only the arithmetic. The exception is raised in the guarded block itself,
+ * just as though entering it had failed, so its handlers, LEAVE and FINALLY
+ * all run, and code inside it needs no checks of its own: integer division
+ * by zero and INT_MIN / -1 cost nothing until they happen. Both are undefined
+ * in C, so this relies on the division being executed, as it is whenever
+ * the compiler can not see the operands.
+ *
+ * A guard is an ex_signal_guard on the stack of the block it protects, pushed
+ * on a per-thread list, and carrying the block's sigsetjmp target. Handlers
+ * for SIGFPE, SIGBUS and SIGSEGV are installed once per process, on first
+ * use. When a signal is claimed by a guard on the faulting thread, the handler
+ * siglongjmps back to the innermost such block, and any other signal goes to
+ * whatever handler was installed before, or kills the process as usual.
+ * Other guarded forms, such as TRY_MAPPED in libex_mapped.h, are built on the
+ * same guards with their own exceptions.
+ *
+ * The jump skips the rest of every scope between the fault and the guarded
+ * block, including the LEAVE and FINALLY of blocks nested inside it, so code
+ * running under a guard should not acquire resources of its own. As with any
+ * setjmp, locals of the guarded function that are modified inside the block
+ * and read after a fault must be volatile.
+ *
+ * The signals are handled with SA_NODEFER, so the jump needs no signal mask
+ * restored, and entering a guarded block costs a sigsetjmp that saves no mask:
+ * no system call. Floating-point division by zero does not trap unless
+ * enabled with feenableexcept. POSIX only.
+ */
+
+#ifndef __LIBEX_SIGNAL__
+#define __LIBEX_SIGNAL__
+
+#include "libex.h"
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+typedef struct ex_signal_guard {
+	char *base;
+	size_t size;		/* faults in [base, base + size) are caught */
+	exc_type fault;		/* raised for them */
+	exc_type arith;		/* raised for SIGFPE, or ENoError to pass it on */
+	exc_type raised;	/* what the jump back raises */
+	sigjmp_buf env;
+	struct ex_signal_guard *prev;
+} ex_signal_guard;
+
+LIBEX_SHARED LIBEX_TLS ex_signal_guard *ex_signal_top = NULL;
+
+LIBEX_SHARED pthread_once_t ex_signal_once = PTHREAD_ONCE_INIT;
+LIBEX_SHARED int ex_signal_status = 0;
+LIBEX_SHARED struct sigaction ex_signal_oldfpe, ex_signal_oldbus, ex_signal_oldsegv;
+
+/* pass a fault no guard claims to the handler installed before ours */
+static inline void ex_signal_chain(int sig, siginfo_t *info, void *ctx) {
+	struct sigaction *old = sig == SIGFPE ? &ex_signal_oldfpe
+		: sig == SIGBUS ? &ex_signal_oldbus : &ex_signal_oldsegv;
+	if (old->sa_flags & SA_SIGINFO) {
+		old->sa_sigaction(sig, info, ctx);
+	} else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+		old->sa_handler(sig);
+	} else {
+		/* returning re-executes the faulting access, which now kills us */
+		signal(sig, SIG_DFL);
+	}
+}
+
+static void ex_signal_handler(int sig, siginfo_t *info, void *ctx) {
+	char *addr = (char*)info->si_addr;
+	ex_signal_guard *g;
+	for (g = ex_signal_top; g != NULL; g = g->prev) {
+		if (sig == SIGFPE) {
+			g->raised = g->arith;
+		} else if (addr >= g->base && (size_t)(addr - g->base) < g->size) {
+			g->raised = g->fault;
+		} else {
+			continue;
+		}
+		if (g->raised != ENoError) {
+			/* guards of the blocks jumped over are abandoned with them */
+			ex_signal_top = g;
+			siglongjmp(g->env, 1);
+		}
+	}
+	ex_signal_chain(sig, info, ctx);
+}
+
+static void ex_signal_setup(void) {
+	struct sigaction sa;
+	sa.sa_sigaction = ex_signal_handler;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGFPE, &sa, &ex_signal_oldfpe) != 0
+	 || sigaction(SIGBUS, &sa, &ex_signal_oldbus) != 0
+	 || sigaction(SIGSEGV, &sa, &ex_signal_oldsegv) != 0) {
+		ex_signal_status = errno;
+	}
+}
+
+/* install the fault handlers, once per process */
+static inline exc_type ex_signal_install(void) {
+	pthread_once(&ex_signal_once, ex_signal_setup);
+	return (exc_type)ex_signal_status;
+}
+
+/* guard size bytes at base against faults, raising fault for them, and
+ * raise arith for SIGFPE unless it is ENoError; the caller then sets g's
+ * sigsetjmp target */
+static inline void ex_signal_push(ex_signal_guard *g, void *base, size_t size, exc_type fault, exc_type arith) {
+	g->base = (char*)base;
+	g->size = size;
+	g->fault = fault;
+	g->arith = arith;
+	g->raised = ENoError;
+	g->prev = ex_signal_top;
+	ex_signal_top = g;
+}
+
+/* remove g, if it was pushed, once its block is done */
+static inline void ex_signal_pop(ex_signal_guard *g) {
+	if (ex_signal_top == g) ex_signal_top = g->prev;
+}
+
+/* TRY_GUARDED(BASE, SIZE, D) is TRY(D), but raises EOutOfRange in the block
+ * for a SIGFPE, and EBadAddress for a fault in SIZE bytes at BASE */
+#define TRY_GUARDED(BASE, SIZE, D) TRY_WITH(ex_signal_guard __ex_guarded, \
+	if (ENoError == (THROWS = ex_signal_install())) { \
+		ex_signal_push(&__ex_guarded, (BASE), (SIZE), EBadAddress, EOutOfRange); \
+		if (sigsetjmp(__ex_guarded.env, 0)) THROWS = __ex_guarded.raised; \
+	}, \
+	ex_signal_pop(&__ex_guarded), D)
+
+#endif /*__LIBEX_SIGNAL__*/
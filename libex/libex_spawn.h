@@ -0,0 +1,160 @@
+/*
+ * Launching processes with vfork, with exec failures raised in the parent.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * char *argv[] = { "convert", in, out, NULL };
+ * int fds[3] = { -1, log_fd, log_fd };
+ * ex_child child;
+ * TRY_SPAWN(child, "/usr/bin/convert", argv, NULL, fds, ) {
+ * } IN {
+ *     ERROR(ex_child_wait(&child))
+ *     ERRORE(!WIFEXITED(child.status) || WEXITSTATUS(child.status) != 0, EIOError)
+ * } HANDLE CATCH (EPathNotFound) {
+ *     ... not installed
+ * } CATCH (EPermissionDenied) {
+ *     ... not executable
+ * } CATCHANY {
+ *     RETHROW;
+ * } FINALLY {
+ * }
+ *
+ * With fork and exec, a child that fails to exec can only tell its parent
+ * through its exit status, and fork first copies the page tables of the
+ * parent, which takes longer the more memory the parent has mapped.
+ * ex_spawn starts the child with vfork, which shares the parent's memory
+ * until the child calls execve, and hands the child a pipe whose write end
+ * is close-on-exec. If execve succeeds, the pipe closes and the parent reads
+ * nothing. If it fails, the child writes its errno to the pipe before it
+ * exits, and ex_spawn reaps it and raises that error, EPathNotFound,
+ * EPermissionDenied, EInvalidExecutable or whichever it was, so the caller
+ * handles it in the same TRY as everything else. PATH is not searched.
+ *
+ * fds, if not NULL, gives the descriptors the child gets as its standard
+ * input, output and error, with -1 to inherit the parent's. envp NULL passes
+ * the parent's environment. The child starts with the signal handlers of the
+ * parent reset to their defaults and the parent's signal mask.
+ *
+ * A child is reaped exactly once, by its ex_child, which forgets its pid as
+ * soon as it has been reaped, so no pid is ever waited for or signalled after
+ * it may have been reused. Reaping never polls, so an expired deadline or a
+ * canceled token can not leave a child behind. ex_child_wait waits for the child and keeps its
+ * wait status. TRY_SPAWN(C, PATH, ARGV, ENVP, FDS, D) is TRY(D), but first
+ * spawns the child into the ex_child C, raising any failure to its
+ * handlers, and when the block exits, before the FINALLY body, reaps the
+ * child if the block has not: a block that succeeds waits for it, and a
+ * block that fails kills it first. Nothing else in the process may reap
+ * children of its own accord, with waitpid(-1, ...) or SIGCHLD set to
+ * SIG_IGN, or waiting raises ENoChildProcesses. Linux and the BSDs.
+ */
+
+#ifndef __LIBEX_SPAWN__
+#define __LIBEX_SPAWN__
+
+#include "libex.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+typedef struct ex_child {
+	pid_t pid;		/* -1 once reaped */
+	int status;		/* the wait status, once reaped */
+} ex_child;
+
+/* the vfork child; it shares the parent's memory, so it only makes system
+ * calls and never returns */
+static void __attribute__((noinline, noreturn, unused)) ex_spawn_child(const char *path,
+	char *const argv[], char *const envp[], const int fds[3], int errfd, const sigset_t *mask) {
+	struct sigaction sa;
+	int i, err;
+	/* keep the error pipe clear of the standard descriptors */
+	if (errfd < 3) errfd = fcntl(errfd, F_DUPFD_CLOEXEC, 3);
+	for (i = 1; i < NSIG; ++i) {
+		if (sigaction(i, NULL, &sa) == 0 && sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+			sa.sa_handler = SIG_DFL;
+			sa.sa_flags = 0;
+			sigaction(i, &sa, NULL);
+		}
+	}
+	for (i = 0; fds != NULL && i < 3; ++i) {
+		if (fds[i] < 0) continue;
+		if (fds[i] == i ? fcntl(i, F_SETFD, 0) != 0 : dup2(fds[i], i) != i) goto failed;
+	}
+	if (pthread_sigmask(SIG_SETMASK, mask, NULL) != 0) goto failed;
+	execve(path, argv, envp != NULL ? envp : environ);
+failed:
+	err = errno;
+	while (write(errfd, &err, sizeof(err)) < 0 && errno == EINTR);
+	_exit(127);
+}
+
+/* wait for c's child, keeping its wait status in c->status; not a check
+ * point, so the child is reaped whatever exception is pending */
+static inline exc_type ex_child_wait(ex_child *c) {
+	pid_t r;
+	if (c->pid == -1) return ENoChildProcesses;
+	while ((r = waitpid(c->pid, &c->status, 0)) < 0 && errno == EINTR);
+	/* the child is gone either way */
+	c->pid = -1;
+	return r < 0 ? (exc_type)errno : ENoError;
+}
+
+/* start path with argv as a child process in c, raising the reason if it can
+ * not be executed */
+static inline exc_type ex_spawn(ex_child *c, const char *path, char *const argv[], char *const envp[], const int fds[3]) {
+	THROWS(EPathNotFound, EPermissionDenied, EInvalidExecutable, ...)
+	int errpipe[2] = { -1, -1 }, err = 0;
+	sigset_t all, mask;
+	ssize_t n;
+	c->pid = -1;
+	c->status = 0;
+	TRY() {
+		ERRORE(0 != pipe2(errpipe, O_CLOEXEC), errno);
+	} IN {
+		/* no handler may run in the child while it shares our memory */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &mask);
+		c->pid = vfork();
+		if (c->pid == 0) ex_spawn_child(path, argv, envp, fds, errpipe[1], &mask);
+		err = errno;
+		pthread_sigmask(SIG_SETMASK, &mask, NULL);
+		/* from here the child must be reaped before raising anything */
+		ERRORE_UNPOLLED(c->pid < 0, err);
+		close(errpipe[1]);
+		errpipe[1] = -1;
+		while ((n = read(errpipe[0], &err, sizeof(err))) < 0 && errno == EINTR);
+		if (n == sizeof(err)) {
+			ex_child_wait(c);
+			THROW(err)
+		}
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		if (errpipe[0] != -1) close(errpipe[0]);
+		if (errpipe[1] != -1) close(errpipe[1]);
+	}
+	DONE;
+}
+
+/* reap c's child as its block exits with e, killing it first if the block
+ * failed, and return the exception propagating out of the block */
+static inline exc_type ex_child_end(ex_child *c, exc_type e) {
+	exc_type f;
+	if (c->pid == -1) return e;
+	if (e != ENoError && e != EEarlyReturn) kill(c->pid, SIGKILL);
+	f = ex_child_wait(c);
+	return e == ENoError || e == EEarlyReturn ? (f != ENoError ? f : e) : e;
+}
+
+/* TRY_SPAWN(C, PATH, ARGV, ENVP, FDS, D) is TRY(D), but first spawns PATH
+ * into the ex_child C, and reaps it when the block exits */
+#define TRY_SPAWN(C, PATH, ARGV, ENVP, FDS, D) TRY_WITH(, \
+	THROWS = ex_spawn(&(C), (PATH), (ARGV), (ENVP), (FDS)), \
+	THROWS = ex_child_end(&(C), THROWS), D)
+
+#endif /*__LIBEX_SPAWN__*/
@@ -0,0 +1,175 @@
+/*
+ * Zero-copy transfers between descriptors, resumable after an exception.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * ex_transfer_buf buf = EX_TRANSFER_BUF_INIT;
+ * size_t done = 0;
+ *
+ * TRY() {
+ *     ERROR(ex_transfer(file_fd, sock_fd, len, &done, &buf))
+ * } IN {
+ *     ... done < len only if file_fd hit end of file
+ * } HANDLE CATCH (EWouldBlock) {
+ *     ... wait for sock_fd to become writable, then make the same call again
+ * } FINALLY {
+ * }
+ *
+ * Every transfer moves bytes until *done reaches len, looping over short
+ * transfers and EInterrupted, and stops early only at end of input. *done is
+ * advanced by every byte written, including when the call raises, so after
+ * EWouldBlock, EBrokenPipe or any other exception, it says exactly how far
+ * the transfer got, and repeating the identical call resumes from there.
+ *
+ * ex_copy_file_range, ex_sendfile and ex_splice use one kernel path each.
+ * ex_transfer tries them in that order, moving on whenever one reports that
+ * it does not apply to these descriptors (EArgumentInvalid, EUnsupported,
+ * EInvalidSocketOp, ECrossDeviceLink, EFunctionUnsupported, or EBadDescriptor
+ * for an O_APPEND output), and falls back to a read/write loop through buf,
+ * which is allocated on first use and can be reused across transfers. Bytes read but not yet written stay in buf, so
+ * a resumed transfer writes them first. If copy_file_range moves nothing at
+ * all, ex_transfer reads and writes instead, since procfs, sysfs and FUSE
+ * files report end of input to it with data left, so an empty input costs
+ * one more read. ex_copy_file_range alone can not tell the two apart.
+ *
+ * Linux only, compiled with _GNU_SOURCE for copy_file_range and splice.
+ */
+
+#ifndef __LIBEX_TRANSFER__
+#define __LIBEX_TRANSFER__
+
+#include "libex.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+
+/* the most each system call is asked to move */
+#define EX_TRANSFER_CHUNK ((size_t)1 << 30)
+
+#ifndef LIBEX_TRANSFER_BUF
+#define LIBEX_TRANSFER_BUF 65536
+#endif
+
+typedef struct ex_transfer_buf {
+	char *data;
+	size_t head, tail;	/* bytes read but not yet written */
+} ex_transfer_buf;
+
+#define EX_TRANSFER_BUF_INIT { NULL, 0, 0 }
+
+static inline void ex_transfer_buf_free(ex_transfer_buf *b) {
+	free(b->data);
+	b->data = NULL;
+	b->head = b->tail = 0;
+}
+
+enum { EX_COPY_FILE_RANGE, EX_SENDFILE, EX_SPLICE };
+
+static inline ssize_t ex_transfer_call(int kind, int in, int out, size_t n) {
+	switch (kind) {
+	case EX_COPY_FILE_RANGE: return copy_file_range(in, NULL, out, NULL, n, 0);
+	case EX_SENDFILE: return sendfile(out, in, NULL, n);
+	default: return splice(in, NULL, out, NULL, n, SPLICE_F_MOVE);
+	}
+}
+
+/* move bytes with one kernel path until *done reaches len or input ends */
+static inline exc_type ex_transfer_with(int kind, int in, int out, size_t len, size_t *done) {
+	THROWS(EWouldBlock, EBrokenPipe, ...)
+	while (*done < len) {
+		size_t want = len - *done < EX_TRANSFER_CHUNK ? len - *done : EX_TRANSFER_CHUNK;
+		ssize_t n = ex_transfer_call(kind, in, out, want);
+		if (n == 0) break;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			THROW(errno)
+		}
+		*done += (size_t)n;
+		CANCELPOINT
+	}
+	THROWONERROR;
+	DONE;
+}
+
+static inline exc_type ex_copy_file_range(int in, int out, size_t len, size_t *done) {
+	return ex_transfer_with(EX_COPY_FILE_RANGE, in, out, len, done);
+}
+
+static inline exc_type ex_sendfile(int in, int out, size_t len, size_t *done) {
+	return ex_transfer_with(EX_SENDFILE, in, out, len, done);
+}
+
+static inline exc_type ex_splice(int in, int out, size_t len, size_t *done) {
+	return ex_transfer_with(EX_SPLICE, in, out, len, done);
+}
+
+/* move bytes with read and write through b */
+static inline exc_type ex_transfer_copy(int in, int out, size_t len, size_t *done, ex_transfer_buf *b) {
+	THROWS(EOutOfMemory, EWouldBlock, EBrokenPipe, ...)
+	if (b->data == NULL) {
+		MAYBE(b->data = (char*)malloc(LIBEX_TRANSFER_BUF), EOutOfMemory);
+	}
+	while (*done < len) {
+		ssize_t n;
+		if (b->head == b->tail) {
+			size_t want = len - *done < LIBEX_TRANSFER_BUF ? len - *done : LIBEX_TRANSFER_BUF;
+			n = read(in, b->data, want);
+			if (n == 0) break;
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				THROW(errno)
+			}
+			b->head = 0;
+			b->tail = (size_t)n;
+		}
+		n = write(out, b->data + b->head, b->tail - b->head);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			THROW(errno)
+		}
+		b->head += (size_t)n;
+		if (b->head == b->tail) b->head = b->tail = 0;
+		*done += (size_t)n;
+		CANCELPOINT
+	}
+	THROWONERROR;
+	DONE;
+}
+
+/* whether a kernel path failed because it does not apply to the descriptors;
+ * copy_file_range reports an O_APPEND output as EBadDescriptor, and a truly
+ * bad descriptor still fails the read/write fallback the same way */
+static inline int ex_transfer_inapplicable(exc_type e) {
+	return e == EArgumentInvalid || e == EUnsupported || e == EInvalidSocketOp
+		|| e == ECrossDeviceLink || e == EFunctionUnsupported || e == EBadDescriptor;
+}
+
+/* move bytes with the first kernel path that applies, or read and write */
+static inline exc_type ex_transfer(int in, int out, size_t len, size_t *done, ex_transfer_buf *b) {
+	THROWS(EOutOfMemory, EWouldBlock, EBrokenPipe, ...)
+	int kind = EX_COPY_FILE_RANGE;
+	exc_type e = ENoError;
+	/* bytes left over from an interrupted fallback go out first */
+	if (b->head != b->tail) kind = EX_SPLICE + 1;
+	for (; kind <= EX_SPLICE; ++kind) {
+		size_t before = *done;
+		e = ex_transfer_with(kind, in, out, len, done);
+		if (kind == EX_COPY_FILE_RANGE && e == ENoError && *done == before && before < len) {
+			/* procfs, sysfs and FUSE files can report end of input to
+			 * copy_file_range with data left, which only read can tell */
+			kind = EX_SPLICE;
+			e = EUnsupported;
+		}
+		if (!ex_transfer_inapplicable(e)) break;
+	}
+	if (kind <= EX_SPLICE) {
+		ERROR(e);
+	} else {
+		ERROR(ex_transfer_copy(in, out, len, done, b));
+	}
+	DONE;
+}
+
+#endif /*__LIBEX_TRANSFER__*/
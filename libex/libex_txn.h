@@ -0,0 +1,146 @@
+/*
+ * Undo-logged transactions over in-memory data.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * TRY_TXN(size_t slot) {
+ *     ERROR(find_slot(index, key, &slot))
+ *     TXN_WRITE(&index->keys[slot], key);
+ *     TXN_WRITE(&index->count, index->count + 1);
+ *     ERROR(update_postings(index, slot))
+ * } IN {
+ *     ...
+ * } HANDLE CATCHANY {
+ *     ... the TXN_WRITEs above are undone once the handlers are done
+ * } FINALLY {
+ * }
+ *
+ * TXN_WRITE(PTR, VALUE) saves the bytes at PTR in the current thread's undo
+ * log before storing VALUE. If an exception propagates out of the TRY scope
+ * or the handlers, the log is replayed in reverse when the block exits, before
+ * the FINALLY body, restoring every location written in the block, including
+ * by callees. On success the entries are simply dropped, so only the bytes
+ * actually written are ever copied. Transactions nest: an inner one that
+ * fails undoes only its own writes, and one that succeeds leaves its entries
+ * to be undone if an enclosing one fails.
+ *
+ * Stores not made through TXN_WRITE are not undone. The log grows with
+ * realloc, and TXN_WRITE raises EOutOfMemory, without storing, if it cannot.
+ * A thread's log is kept for reuse, and ex_txn_release() frees it.
+ */
+
+#ifndef __LIBEX_TXN__
+#define __LIBEX_TXN__
+
+#include "libex.h"
+#include <string.h>
+
+typedef struct ex_txn_log {
+	unsigned char *buf;
+	size_t used, cap;
+	unsigned depth;		/* transactions open on this thread */
+} ex_txn_log;
+
+/* an entry is the old bytes padded to a word, then this trailer, so the
+ * log can be walked backwards */
+typedef struct ex_txn_entry {
+	void *addr;
+	size_t size;
+} ex_txn_entry;
+
+LIBEX_SHARED LIBEX_TLS ex_txn_log ex_txn = { NULL, 0, 0, 0 };
+
+#define EX_TXN_PAD(N) (((N) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+static inline int ex_txn_grow(size_t need) {
+	size_t cap = ex_txn.cap ? ex_txn.cap : 4096;
+	unsigned char *buf;
+	while (cap - ex_txn.used < need) cap *= 2;
+	if (NULL == (buf = (unsigned char*)realloc(ex_txn.buf, cap))) return 0;
+	ex_txn.buf = buf;
+	ex_txn.cap = cap;
+	return 1;
+}
+
+/* copy size bytes, with the word sizes TXN_WRITE mostly sees done inline */
+static inline void ex_txn_copy(void *to, const void *from, size_t size) {
+	switch (size) {
+	case 1: memcpy(to, from, 1); break;
+	case 2: memcpy(to, from, 2); break;
+	case 4: memcpy(to, from, 4); break;
+	case 8: memcpy(to, from, 8); break;
+	default: memcpy(to, from, size); break;
+	}
+}
+
+/* save the size bytes at addr, returning 0 if the log could not grow */
+static inline int ex_txn_save(void *addr, size_t size) {
+	size_t need = EX_TXN_PAD(size) + sizeof(ex_txn_entry);
+	size_t used = ex_txn.used;
+	unsigned char *at;
+	ex_txn_entry e;
+	if (ex_txn.cap - used < need && !ex_txn_grow(need)) return 0;
+	at = ex_txn.buf + used;
+	ex_txn.used = used + need;
+	memcpy(at, addr, size);
+	e.addr = addr;
+	e.size = size;
+	memcpy(at + EX_TXN_PAD(size), &e, sizeof(e));
+	return 1;
+}
+
+static inline size_t ex_txn_begin(void) {
+	++ex_txn.depth;
+	return ex_txn.used;
+}
+
+/* restore every location saved since mark, newest first */
+static inline void ex_txn_undo(size_t mark) {
+	unsigned char *buf = ex_txn.buf;
+	size_t used = ex_txn.used;
+	while (used > mark) {
+		ex_txn_entry e;
+		memcpy(&e, buf + used - sizeof(e), sizeof(e));
+		/* a predicted branch rather than a stride computed from the entry,
+		 * so that the walk does not wait on each entry's load */
+		if (e.size == sizeof(void*)) {
+			used -= sizeof(e) + sizeof(void*);
+			memcpy(e.addr, buf + used, sizeof(void*));
+		} else {
+			used -= sizeof(e) + EX_TXN_PAD(e.size);
+			ex_txn_copy(e.addr, buf + used, e.size);
+		}
+	}
+	ex_txn.used = used;
+}
+
+/* undo the transaction begun at mark if it failed with e; the outermost
+ * transaction drops the log when it succeeds */
+static inline void ex_txn_end(size_t mark, exc_type e) {
+	--ex_txn.depth;
+	if (e != ENoError && e != EEarlyReturn) {
+		ex_txn_undo(mark);
+	} else if (ex_txn.depth == 0) {
+		ex_txn.used = 0;
+	}
+}
+
+/* free the current thread's log, outside of any transaction */
+static inline void ex_txn_release(void) {
+	free(ex_txn.buf);
+	ex_txn.buf = NULL;
+	ex_txn.used = ex_txn.cap = 0;
+}
+
+/* TRY_TXN(D) is TRY(D), but undoes the block's TXN_WRITEs if an exception
+ * propagates out of it */
+#define TRY_TXN(D) TRY_WITH(size_t __ex_txn = ex_txn_begin(), , ex_txn_end(__ex_txn, THROWS), D)
+
+/* TXN_WRITE(PTR, VALUE) logs the old value at PTR, then stores VALUE there */
+#define TXN_WRITE(PTR, VALUE) { \
+	if (!ex_txn_save((PTR), sizeof(*(PTR)))) THROW(EOutOfMemory) \
+	*(PTR) = (VALUE); }
+
+#endif /*__LIBEX_TXN__*/
@@ -0,0 +1,358 @@
+/*
+ * Directory tree walks with getdents64 and openat, and an exception policy
+ * per entry.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * static exc_type count(void *ctx, const ex_walk_entry *e) {
+ *     ++((stats*)ctx)->entries;
+ *     return ENoError;
+ * }
+ *
+ * static exc_type tolerate(void *ctx, const ex_walk_entry *e, exc_type err) {
+ *     THROWS(...)
+ *     TRY() {
+ *         ERROR(err)
+ *     } IN {
+ *     } HANDLE CATCH (EPermissionDenied) {
+ *         ++((stats*)ctx)->denied;        record, and skip the entry
+ *     } CATCH (EPathNotFound) {
+ *                                         unlinked under us: skip it
+ *     } CATCHANY {
+ *         RETHROW;                        anything else aborts the walk
+ *     } FINALLY {
+ *     }
+ *     DONE;
+ * }
+ *
+ * ERROR(ex_walk("/srv/data", count, tolerate, &s))
+ *
+ * ex_walk calls visit on every entry below root, a directory before its
+ * contents. Each directory is read LIBEX_WALK_BUF bytes of entries per
+ * getdents64 call, and entries are looked up relative to their directory's
+ * descriptor with openat, so paths are never resolved from the root again.
+ * Symbolic links are reported but not followed. e->path is the entry's path
+ * relative to root, valid during the call.
+ *
+ * Anything that goes wrong with one entry, whether opening it as a
+ * directory, reading it or allocating the buffer to read it into
+ * (EOutOfMemory), nesting deeper than LIBEX_WALK_DEPTH
+ * (ETooManyLevels), a path longer than PATH_MAX (ENameTooLong) or an
+ * exception returned by visit, is handed to policy along with the entry.
+ * If policy returns ENoError, the walk skips what is left of that entry and
+ * goes on, and otherwise the walk stops and raises what it returned. A NULL
+ * policy stops at the first error.
+ *
+ * ex_walk_parallel walks the subdirectories of root on the threads of an
+ * ex_pool from libex_parallel.h, so visit and policy must then be thread
+ * safe. Each thread of the pool keeps one walker, and its buffers, for all
+ * the subtrees it walks. Which subtree's abort is raised, if several abort,
+ * is deterministic, as with ex_parallel_for. Linux only.
+ */
+
+#ifndef __LIBEX_WALK__
+#define __LIBEX_WALK__
+
+#include "libex.h"
+#include "libex_parallel.h"
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef LIBEX_WALK_BUF
+#define LIBEX_WALK_BUF 32768
+#endif
+#ifndef LIBEX_WALK_DEPTH
+#define LIBEX_WALK_DEPTH 256
+#endif
+
+typedef struct ex_walk_entry {
+	int dirfd;		/* the directory holding the entry */
+	const char *name;	/* within dirfd */
+	const char *path;	/* relative to the root */
+	unsigned char type;	/* DT_DIR, DT_REG, DT_LNK, ... */
+	unsigned depth;		/* 1 for entries of the root */
+} ex_walk_entry;
+
+typedef exc_type (*ex_walk_visit)(void *ctx, const ex_walk_entry *e);
+typedef exc_type (*ex_walk_policy)(void *ctx, const ex_walk_entry *e, exc_type err);
+
+/* the layout getdents64 fills its buffer with */
+typedef struct ex_dirent64 {
+	uint64_t ino;
+	int64_t off;
+	unsigned short reclen;
+	unsigned char type;
+	char name[];
+} ex_dirent64;
+
+/* the state of one thread's walk */
+typedef struct ex_walker {
+	ex_walk_visit visit;
+	ex_walk_policy policy;
+	void *ctx;
+	size_t len;		/* of path */
+	char path[PATH_MAX];
+	char *bufs[LIBEX_WALK_DEPTH];	/* one getdents64 buffer per level */
+} ex_walker;
+
+static inline void ex_walker_init(ex_walker *w, ex_walk_visit visit, ex_walk_policy policy, void *ctx) {
+	w->visit = visit;
+	w->policy = policy;
+	w->ctx = ctx;
+	w->len = 0;
+	w->path[0] = '\0';
+	memset(w->bufs, 0, sizeof(w->bufs));
+}
+
+static inline void ex_walker_destroy(ex_walker *w) {
+	size_t i;
+	for (i = 0; i < LIBEX_WALK_DEPTH; ++i) free(w->bufs[i]);
+}
+
+/* let the policy decide what becomes of e's error */
+static inline exc_type ex_walk_fail(ex_walker *w, const ex_walk_entry *e, exc_type err) {
+	return w->policy == NULL ? err : w->policy(w->ctx, e, err);
+}
+
+static inline exc_type ex_walk_entry_at(ex_walker *w, int dirfd, const char *name, unsigned char type, unsigned depth);
+
+/* visit the entries of the directory open at fd, which is dir */
+static inline exc_type ex_walk_dir(ex_walker *w, int fd, const ex_walk_entry *dir) {
+	THROWS(...)
+	char *buf = w->bufs[dir->depth];
+	if (buf == NULL && NULL == (buf = w->bufs[dir->depth] = (char*)malloc(LIBEX_WALK_BUF))) {
+		/* the directory can not be read at all */
+		ERROR(ex_walk_fail(w, dir, EOutOfMemory));
+		RETURN;
+	}
+	for (;;) {
+		long n = syscall(SYS_getdents64, fd, buf, LIBEX_WALK_BUF), off;
+		if (n == 0) break;
+		if (n < 0) {
+			/* the rest of the directory can not be read */
+			THROWS = ex_walk_fail(w, dir, (exc_type)errno);
+			break;
+		}
+		for (off = 0; off < n; ) {
+			ex_dirent64 *d = (ex_dirent64*)(buf + off);
+			off += d->reclen;
+			if (d->name[0] == '.' && (d->name[1] == '\0' || (d->name[1] == '.' && d->name[2] == '\0'))) continue;
+			if (ENoError != (THROWS = ex_walk_entry_at(w, fd, d->name, d->type, dir->depth + 1))) break;
+		}
+		THROWONERROR;
+	}
+	THROWONERROR;
+	DONE;
+}
+
+/* visit one entry, and walk it if it is a directory */
+static inline exc_type ex_walk_entry_at(ex_walker *w, int dirfd, const char *name, unsigned char type, unsigned depth) {
+	size_t saved = w->len, n = strlen(name);
+	ex_walk_entry e;
+	exc_type err = ENoError, result = ENoError;
+	int fd;
+	e.dirfd = dirfd;
+	e.name = name;
+	e.path = w->path;
+	e.type = type;
+	e.depth = depth;
+	if (saved + (saved != 0) + n >= sizeof(w->path)) {
+		e.path = name;
+		return ex_walk_fail(w, &e, ENameTooLong);
+	}
+	if (saved != 0) w->path[w->len++] = '/';
+	memcpy(w->path + w->len, name, n + 1);
+	w->len += n;
+	if (type == DT_UNKNOWN) {
+		struct stat st;
+		if (0 != fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+			err = (exc_type)errno;
+		} else {
+			e.type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+	}
+	if (err == ENoError) err = w->visit(w->ctx, &e);
+	if (err == ENoError && e.type == DT_DIR) {
+		if (depth >= LIBEX_WALK_DEPTH) {
+			err = ETooManyLevels;
+		} else if (-1 == (fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC))) {
+			err = (exc_type)errno;
+		} else {
+			/* whatever the subtree raises has been through the policy */
+			result = ex_walk_dir(w, fd, &e);
+			close(fd);
+		}
+	}
+	if (err != ENoError) result = ex_walk_fail(w, &e, err);
+	w->len = saved;
+	w->path[saved] = '\0';
+	return result;
+}
+
+/* walk the tree below root, calling visit on every entry and policy on
+ * every entry that fails */
+static inline exc_type ex_walk(const char *root, ex_walk_visit visit, ex_walk_policy policy, void *ctx) {
+	THROWS(...)
+	ex_walker *w = NULL;
+	ex_walk_entry top;
+	int fd = -1;
+	TRY() {
+		/* the walker must be initialized before anything polls */
+		MAYBE_UNPOLLED(w = (ex_walker*)malloc(sizeof(*w)), EOutOfMemory);
+		ex_walker_init(w, visit, policy, ctx);
+		ERRORE(-1 == (fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)), errno);
+	} IN {
+		top.dirfd = AT_FDCWD;
+		top.name = top.path = root;
+		top.type = DT_DIR;
+		top.depth = 0;
+		ERROR(ex_walk_dir(w, fd, &top));
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		if (fd != -1) close(fd);
+		if (w != NULL) ex_walker_destroy(w);
+		free(w);
+	}
+	DONE;
+}
+
+typedef struct ex_walk_job {
+	int rootfd;
+	char *names;		/* the subdirectories of the root, each terminated */
+	size_t *offsets;	/* of each name in names */
+	ex_walk_visit visit;
+	ex_walk_policy policy;
+	void *ctx;
+	ex_walker **walkers;	/* one per pool thread, made on first use */
+} ex_walk_job;
+
+/* walk subdirectories [begin, end) with the walker of the running thread,
+ * which keeps its getdents64 buffers from one subtree to the next */
+static inline exc_type ex_walk_subtrees(void *ctx, size_t begin, size_t end) {
+	THROWS(...)
+	ex_walk_job *job = (ex_walk_job*)ctx;
+	ex_walker *w = job->walkers[ex_parallel_slot];
+	size_t i;
+	if (w == NULL) {
+		/* ex_walk_parallel frees it, along with the others */
+		MAYBE_UNPOLLED(w = (ex_walker*)malloc(sizeof(*w)), EOutOfMemory);
+		ex_walker_init(w, job->visit, job->policy, job->ctx);
+		job->walkers[ex_parallel_slot] = w;
+	}
+	for (i = begin; i < end; ++i) {
+		ERROR(ex_walk_entry_at(w, job->rootfd, job->names + job->offsets[i], DT_DIR, 1));
+	}
+	THROWONERROR;
+	DONE;
+}
+
+/* collect the subdirectories of the root, which is top, in job, visiting
+ * everything else */
+static inline exc_type ex_walk_top(ex_walker *w, ex_walk_job *job, const ex_walk_entry *top, size_t *count) {
+	THROWS(...)
+	char *buf = NULL;
+	size_t used = 0, cap = 0, nsub = 0, max = 0;
+	TRY() {
+		MAYBE(buf = (char*)malloc(LIBEX_WALK_BUF), EOutOfMemory)
+	} IN {
+		for (;;) {
+			long n = syscall(SYS_getdents64, job->rootfd, buf, LIBEX_WALK_BUF), off;
+			if (n == 0) break;
+			if (n < 0) {
+				/* as in ex_walk_dir, the subdirectories found so far are
+				 * still walked if the policy lets the walk go on */
+				THROWS = ex_walk_fail(w, top, (exc_type)errno);
+				break;
+			}
+			for (off = 0; off < n; ) {
+				ex_dirent64 *d = (ex_dirent64*)(buf + off);
+				size_t len = strlen(d->name) + 1;
+				off += d->reclen;
+				if (d->name[0] == '.' && (d->name[1] == '\0' || (d->name[1] == '.' && d->name[2] == '\0'))) continue;
+				if (d->type != DT_DIR) {
+					if (ENoError != (THROWS = ex_walk_entry_at(w, job->rootfd, d->name, d->type, 1))) break;
+					continue;
+				}
+				if (used + len > cap) {
+					char *names = (char*)realloc(job->names, cap = (used + len) * 2);
+					if (names == NULL) THROW(EOutOfMemory)
+					job->names = names;
+				}
+				if (nsub == max) {
+					size_t *offsets = (size_t*)realloc(job->offsets, (max = max ? max * 2 : 64) * sizeof(size_t));
+					if (offsets == NULL) THROW(EOutOfMemory)
+					job->offsets = offsets;
+				}
+				memcpy(job->names + used, d->name, len);
+				job->offsets[nsub++] = used;
+				used += len;
+			}
+			THROWONERROR;
+		}
+		THROWONERROR;
+		*count = nsub;
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		free(buf);
+	}
+	DONE;
+}
+
+/* ex_walk, but with the subdirectories of root walked in parallel on pool */
+static inline exc_type ex_walk_parallel(ex_pool *pool, const char *root, ex_walk_visit visit, ex_walk_policy policy, void *ctx) {
+	THROWS(...)
+	ex_walker *w = NULL;
+	ex_walk_entry top;
+	ex_walk_job job;
+	size_t count = 0, i;
+	job.rootfd = -1;
+	job.names = NULL;
+	job.offsets = NULL;
+	job.visit = visit;
+	job.policy = policy;
+	job.ctx = ctx;
+	job.walkers = NULL;
+	TRY() {
+		MAYBE_UNPOLLED(job.walkers = (ex_walker**)calloc(pool->nthreads, sizeof(ex_walker*)), EOutOfMemory);
+		MAYBE_UNPOLLED(w = (ex_walker*)malloc(sizeof(*w)), EOutOfMemory);
+		ex_walker_init(w, visit, policy, ctx);
+		/* the calling thread walks subtrees with the walker of the top */
+		job.walkers[0] = w;
+		ERRORE(-1 == (job.rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)), errno);
+	} IN {
+		top.dirfd = AT_FDCWD;
+		top.name = top.path = root;
+		top.type = DT_DIR;
+		top.depth = 0;
+		ERROR(ex_walk_top(w, &job, &top, &count));
+		ERROR(ex_parallel_for(pool, count, 1, ex_walk_subtrees, &job));
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		if (job.rootfd != -1) close(job.rootfd);
+		if (job.walkers != NULL) {
+			for (i = 1; i < pool->nthreads; ++i) {
+				if (job.walkers[i] != NULL) ex_walker_destroy(job.walkers[i]);
+				free(job.walkers[i]);
+			}
+		}
+		if (w != NULL) ex_walker_destroy(w);
+		free(w);
+		free(job.walkers);
+		free(job.names);
+		free(job.offsets);
+	}
+	DONE;
+}
+
+#endif /*__LIBEX_WALK__*/
@@ -0,0 +1,142 @@
+/*
+ * Buffered output that coalesces small writes and flushes when a block exits.
+ *
+ * LICENSE: LGPL
+ *
+ * Example:
+ *
+ * ex_writer w;
+ * TRY() {
+ *     ERROR(handle_request(&w, fd, req))
+ * } IN {
+ * } HANDLE CATCH (EBrokenPipe) {
+ *     ... the peer got the first w.committed bytes of the response
+ * } FINALLY {
+ * }
+ *
+ * where handle_request does:
+ *
+ * TRY_WRITER(*w, fd, ) {
+ * } IN {
+ *     ERROR(ex_write(w, header, header_len))
+ *     ERROR(ex_write(w, body, body_len))
+ * } HANDLE CATCHANY {
+ *     RETHROW;
+ * } FINALLY {
+ * }
+ *
+ * ex_write appends to a LIBEX_WRITER_BUF byte buffer inside the writer, and
+ * only calls into the kernel when the data does not fit, in which case the
+ * buffer and the new data go out together in one writev. TRY_WRITER(W, FD, D)
+ * starts the existing ex_writer W on FD, and flushes it when the block exits,
+ * just before the FINALLY body, on every path. If that flush fails, and the
+ * block was otherwise succeeding, its EIOError, ENoSpaceOnDevice, EBrokenPipe
+ * or other exception propagates to the enclosing scope, as any other failure
+ * in the block would. The flush never polls, so an expired deadline or a
+ * canceled token neither fails a flush that wrote everything nor replaces
+ * the exception the block raised. A handful of small writes per request
+ * then costs one system call instead of one each.
+ *
+ * w.committed counts the bytes the descriptor has accepted, and w.used those
+ * still buffered, so after any failure the first committed + used bytes of
+ * everything appended were accepted, and the rest were not. A handler can
+ * use that to decide whether retrying is safe. Short writes and EInterrupted
+ * are retried, and a flush that fails part way keeps the rest buffered.
+ * Writing to a pipe or socket whose reader has gone raises SIGPIPE, so
+ * ignore it to see EBrokenPipe instead. POSIX only.
+ */
+
+#ifndef __LIBEX_WRITER__
+#define __LIBEX_WRITER__
+
+#include "libex.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifndef LIBEX_WRITER_BUF
+#define LIBEX_WRITER_BUF 4096
+#endif
+
+typedef struct ex_writer {
+	int fd;
+	size_t committed;	/* bytes the descriptor has accepted */
+	size_t used;		/* bytes buffered, not yet written */
+	char buf[LIBEX_WRITER_BUF];
+} ex_writer;
+
+static inline void ex_writer_init(ex_writer *w, int fd) {
+	w->fd = fd;
+	w->committed = 0;
+	w->used = 0;
+}
+
+/* drop the first n buffered bytes, which have been written */
+static inline void ex_writer_consume(ex_writer *w, size_t n) {
+	w->committed += n;
+	w->used -= n;
+	if (w->used > 0) memmove(w->buf, w->buf + n, w->used);
+}
+
+/* write everything buffered; not a check point, so a flush that wrote
+ * everything succeeds whatever deadline has passed meanwhile */
+static inline exc_type ex_writer_flush(ex_writer *w) {
+	THROWS(EIOError, ENoSpaceOnDevice, EBrokenPipe, ...)
+	while (w->used > 0) {
+		ssize_t r = write(w->fd, w->buf, w->used);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			THROW(errno)
+		}
+		ex_writer_consume(w, (size_t)r);
+	}
+	THROWONERROR_UNPOLLED;
+	DONE;
+}
+
+/* append n bytes at data, writing them out along with the buffer if they do
+ * not fit in it */
+static inline exc_type ex_write(ex_writer *w, const void *data, size_t n) {
+	THROWS(EIOError, ENoSpaceOnDevice, EBrokenPipe, ...)
+	const char *p = (const char*)data;
+	while (n > LIBEX_WRITER_BUF - w->used) {
+		struct iovec iov[2];
+		ssize_t r;
+		iov[0].iov_base = w->buf;
+		iov[0].iov_len = w->used;
+		iov[1].iov_base = (void*)p;
+		iov[1].iov_len = n;
+		r = writev(w->fd, iov, 2);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			THROW(errno)
+		}
+		if ((size_t)r < w->used) {
+			ex_writer_consume(w, (size_t)r);
+		} else {
+			r -= w->used;
+			w->committed += w->used + (size_t)r;
+			w->used = 0;
+			p += r;
+			n -= (size_t)r;
+		}
+	}
+	THROWONERROR;
+	memcpy(w->buf + w->used, p, n);
+	w->used += n;
+	DONE;
+}
+
+/* flush w as its block exits with e, returning the exception propagating
+ * out of the block */
+static inline exc_type ex_writer_end(ex_writer *w, exc_type e) {
+	exc_type f = ex_writer_flush(w);
+	return e == ENoError || e == EEarlyReturn ? (f != ENoError ? f : e) : e;
+}
+
+/* TRY_WRITER(W, FD, D) is TRY(D), but first starts the ex_writer W on FD, and
+ * flushes it when the block exits, raising any failure to flush */
+#define TRY_WRITER(W, FD, D) TRY_WITH(, ex_writer_init(&(W), (FD)), \
+	THROWS = ex_writer_end(&(W), THROWS), D)
+
+#endif /*__LIBEX_WRITER__*/
@@ -1,8 +1,33 @@
 
+/* Build and run twice, as is and with -DLIBEX_DEADLINE -DLIBEX_CANCEL, which
+ * makes every check point poll and adds the tests of deadlines and
+ * cancellation. */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
 #include "libex.h"
+#include "libex_arena.h"
+#include "libex_reclaim.h"
+#include "libex_txn.h"
+#ifndef _WIN32
+#include "libex_parallel.h"
+#include "libex_dag.h"
+#include "libex_future.h"
+#include "libex_objpool.h"
+#include "libex_reserve.h"
+#include "libex_filetxn.h"
+#include "libex_groupcommit.h"
+#include "libex_transfer.h"
+#include "libex_mapped.h"
+#include "libex_writer.h"
+#include "libex_batch.h"
+#include "libex_loop.h"
+#include <netinet/in.h>
+#define LIBEX_WALK_DEPTH 3
+#include "libex_walk.h"
+#include "libex_spawn.h"
+#endif
 
 /* Tests:
  * 1. returned void, errno test.
@@ -117,6 +142,1453 @@ static exc_type test_maybe(void *p, int* i) {
 	DONE;
 }
 
+#ifdef LIBEX_POLL
+/* a few check points, which must not see an exception already raised */
+static exc_type check_points(void) {
+	THROWS()
+	TRY() {
+		ERROR(ENoError);
+	} IN {
+		MAYBE(&check_points, EUnrecoverable);
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+#endif
+
+#ifdef LIBEX_DEADLINE
+static exc_type test_deadline(int* p) {
+	THROWS(ETimedout)
+	TRY_DEADLINE(0, ) {
+		mark(p);
+		ERROR(ENoError);
+		assert(0);
+	} IN {
+		assert(0);
+	} HANDLE CATCH(ETimedout) {
+		mark(p);
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		mark(p);
+		assert(ex_deadline_at == 0);
+	}
+	TRY_DEADLINE(3600000000000ULL, ) {
+		uint64_t outer = ex_deadline_at;
+		TRY_DEADLINE(7200000000000ULL, ) {
+			/* nested deadlines never extend the enclosing one */
+			assert(ex_deadline_at == outer);
+		} IN {
+			TRY_DEADLINE(1000000000, ) {
+				assert(ex_deadline_at < outer);
+			} IN {
+				mark(p);
+			} HANDLE CATCHANY {
+				assert(0);
+			} FINALLY {
+				assert(ex_deadline_at == outer);
+			}
+		} HANDLE CATCHANY {
+			assert(0);
+		} FINALLY {
+		}
+	} IN {
+		TRY_DEADLINE(0, ) {
+		} IN {
+			ERROR(ENoError);
+			assert(0);
+		} HANDLE CATCHANY {
+			assert(0);
+		} FINALLY {
+			mark(p);
+		}
+		ENDTRY;
+		assert(0);
+	} HANDLE CATCHANY {
+		assert(0);
+	} FINALLY {
+		assert(ex_deadline_at == 0);
+	}
+	DONE;
+}
+
+/* ETimedout is raised once per block, but again after it was handled */
+static exc_type test_deadline_once(int* p) {
+	THROWS(ETimedout)
+	TRY_DEADLINE(1000000, ) {
+		TRY_DEADLINE(3600000000000ULL, ) {
+			while (!ex_deadline_expired());
+			ERROR(ENoError);
+			assert(0);
+		} IN {
+			assert(0);
+		} HANDLE CATCH(ETimedout) {
+			mark(p);
+			assert(check_points() == ENoError);
+		} CATCHANY {
+			assert(0);
+		} FINALLY {
+		}
+		/* handled, so the enclosing deadline raises in turn */
+		ERROR(ENoError);
+		assert(0);
+	} IN {
+		assert(0);
+	} HANDLE CATCH(ETimedout) {
+		mark(p);
+		assert(check_points() == ENoError);
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		assert(ex_deadline_at == 0);
+	}
+	TRY_DEADLINE(1000000, ) {
+		TRY_DEADLINE(3600000000000ULL, ) {
+			while (!ex_deadline_expired());
+			ERROR(ENoError);
+		} IN {
+		} HANDLE CATCHANY {
+			RETHROW;
+		} FINALLY {
+			/* propagating, so the expired enclosing deadline stays quiet */
+			mark(p);
+			assert(check_points() == ENoError);
+		}
+		ENDTRY;
+		assert(0);
+	} IN {
+		assert(0);
+	} HANDLE CATCH(ETimedout) {
+		mark(p);
+		assert(check_points() == ENoError);
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		assert(ex_deadline_at == 0);
+	}
+	DONE;
+}
+#endif
+
+#ifdef LIBEX_CANCEL
+static exc_type test_cancel(int* p) {
+	THROWS(ECanceled)
+	ex_cancel_token tok = EX_CANCEL_TOKEN_INIT;
+	TRY_CANCELABLE(&tok, ) {
+		mark(p);
+		MAYBE(p, EUnrecoverable);
+		ex_cancel(&tok);
+		MAYBE(p, EUnrecoverable);
+		assert(0);
+	} IN {
+		assert(0);
+	} HANDLE CATCH(ECanceled) {
+		mark(p);
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		mark(p);
+		assert(ex_cancel_current == &ex_cancel_never);
+	}
+	ex_cancel_reset(&tok);
+	TRY_CANCELABLE(&tok, int i) {
+		for (i = 0; i < 100; ++i) {
+			if (i == 10) ex_cancel(&tok);
+			CANCELPOINT;
+		}
+		assert(i == 10);
+		THROWONERROR;
+		assert(0);
+	} IN {
+		assert(0);
+	} HANDLE CATCHANY {
+		mark(p);
+		assert(__CUR_EXC__ == ECanceled);
+		RETHROW;
+	} FINALLY {
+		mark(p);
+	}
+	DONE;
+}
+
+/* ECanceled is raised once per block, but again after it was handled */
+static exc_type test_cancel_once(int* p) {
+	THROWS(ECanceled)
+	ex_cancel_token tok = EX_CANCEL_TOKEN_INIT;
+	TRY_CANCELABLE(&tok, ) {
+		TRY_CANCELABLE(&tok, ) {
+			ex_cancel(&tok);
+			ERROR(ENoError);
+			assert(0);
+		} IN {
+			assert(0);
+		} HANDLE CATCH(ECanceled) {
+			mark(p);
+			assert(check_points() == ENoError);
+		} CATCHANY {
+			assert(0);
+		} FINALLY {
+		}
+		/* handled, so the enclosing block raises in turn */
+		ERROR(ENoError);
+		assert(0);
+	} IN {
+		assert(0);
+	} HANDLE CATCH(ECanceled) {
+		mark(p);
+		assert(check_points() == ENoError);
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		assert(ex_cancel_current == &ex_cancel_never);
+	}
+	ex_cancel_reset(&tok);
+	TRY_CANCELABLE(&tok, ) {
+		TRY_CANCELABLE(&tok, ) {
+			ex_cancel(&tok);
+			ERROR(ENoError);
+		} IN {
+		} HANDLE CATCHANY {
+			RETHROW;
+		} FINALLY {
+			/* propagating, so the enclosing block stays quiet */
+			mark(p);
+			assert(check_points() == ENoError);
+		}
+		ENDTRY;
+		assert(0);
+	} IN {
+		assert(0);
+	} HANDLE CATCH(ECanceled) {
+		mark(p);
+		assert(check_points() == ENoError);
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		assert(ex_cancel_current == &ex_cancel_never);
+	}
+	DONE;
+}
+#endif
+
+static int released[4], nreleased;
+
+static void release(void *arg) {
+	released[nreleased++] = *(int*)arg;
+}
+
+static exc_type test_defer(int acquire, int* p) {
+	THROWS(EOutOfMemory)
+	static int ids[] = { 1, 2, 3 };
+	int i;
+	nreleased = 0;
+	TRY_DEFER() {
+		for (i = 0; i < 3 && i < acquire; ++i) {
+			DEFER(release, &ids[i]);
+		}
+		THROWONERROR;
+		if (i < 3) THROW(EOutOfMemory)
+	} IN {
+		mark(p);
+		assert(nreleased == 0);
+	} HANDLE CATCH(EOutOfMemory) {
+		mark(p);
+		assert(nreleased == 0);
+		RETHROW;
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		mark(p);
+		/* only acquired resources are released, in reverse */
+		assert(nreleased == acquire);
+		for (i = 0; i < nreleased; ++i) assert(released[i] == acquire - i);
+	}
+	DONE;
+}
+
+static int held[5];
+
+static exc_type hold(int i, int fail) {
+	if (i == fail) return EDescriptorTooBig;
+	held[i] = 1;
+	return ENoError;
+}
+
+static exc_type test_each(int fail, int* p) {
+	THROWS(EDescriptorTooBig)
+	int i;
+	nreleased = 0;
+	TRY_EACH(i, 5, hold(i, fail), (released[nreleased++ % 4] = i, held[i] = 0), ) {
+		mark(p);
+	} IN {
+		assert(held[4] && EACH_ACQUIRED(4));
+		/* released early, so the block must not release it again */
+		held[4] = 0;
+		EACH_RELEASED(4);
+	} HANDLE CATCH(EDescriptorTooBig) {
+		mark(p);
+		RETHROW;
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		for (i = 0; i < 5; ++i) assert(!held[i]);
+		assert(nreleased == (fail < 5 ? fail : 4));
+		assert(fail != 3 || (released[0] == 2 && released[2] == 0));
+	}
+	DONE;
+}
+
+static exc_type test_group(size_t big, int* p) {
+	THROWS(EOutOfMemory)
+	TRY_GROUP(char *a; char *b; int *c) {
+		GROUP_ALLOC(GROUP(a, 3) GROUP(b, big) GROUP(c, 4 * sizeof(int)))
+		mark(p);
+	} IN {
+		/* distinct, aligned and writable */
+		assert(b - a == LIBEX_GROUP_ALIGN && ((size_t)c & (LIBEX_GROUP_ALIGN - 1)) == 0);
+		a[2] = 'x';
+		b[big - 1] = 'y';
+		c[3] = 42;
+		assert(a[2] == 'x' && b[big - 1] == 'y' && c[3] == 42);
+	} HANDLE CATCH(EOutOfMemory) {
+		mark(p);
+		RETHROW;
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+	}
+	DONE;
+}
+
+static exc_type test_scratch(size_t n, int* p) {
+	THROWS(EOutOfMemory)
+	char *buf;
+	TRY_SCRATCH(buf, n, ) {
+		mark(p);
+	} IN {
+		buf[0] = 'a';
+		buf[n - 1] = 'z';
+		assert(buf[0] == 'a' && buf[n - 1] == 'z');
+	} HANDLE CATCH(EOutOfMemory) {
+		mark(p);
+		RETHROW;
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+	}
+	DONE;
+}
+
+static size_t heap_budget, cache_bytes;
+static char reclaim_order[4];
+static int nreclaims;
+
+/* an allocator that only succeeds while the budget lasts */
+static void *budget_alloc(size_t n) {
+	static char block[64];
+	if (heap_budget < n) return NULL;
+	heap_budget -= n;
+	return block;
+}
+
+static size_t drop_index(void *ctx, size_t want) {
+	reclaim_order[nreclaims++ % 4] = 'i';
+	return 0;
+}
+
+static size_t drop_cache(void *ctx, size_t want) {
+	size_t freed = cache_bytes;
+	reclaim_order[nreclaims++ % 4] = 'c';
+	heap_budget += freed;
+	cache_bytes = 0;
+	return freed;
+}
+
+static exc_type test_reclaim(size_t n, int* p) {
+	THROWS(EOutOfMemory)
+	char *buf;
+	TRY() {
+		MAYBE_RECLAIM(buf = (char*)budget_alloc(n), n)
+		mark(p);
+	} IN {
+	} HANDLE CATCH(EOutOfMemory) {
+		mark(p);
+		RETHROW;
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+	}
+	DONE;
+}
+
+static exc_type txn_inner(int *v, int fail) {
+	THROWS(EOverflow)
+	TRY_TXN() {
+		TXN_WRITE(&v[1], 20);
+		TXN_WRITE(&v[2], 30);
+		if (fail) THROW(EOverflow)
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+/* fail 1: the inner transaction fails and the outer one carries on,
+ * fail 2: the outer one fails after the inner one succeeded */
+static exc_type test_txn(int fail, int* p) {
+	THROWS(EOverflow)
+	int v[3] = { 1, 2, 3 };
+	TRY_TXN() {
+		TXN_WRITE(&v[0], 10);
+		if (txn_inner(v, fail == 1) != ENoError) {
+			assert(v[0] == 10 && v[1] == 2 && v[2] == 3);
+		}
+		if (fail == 2) THROW(EOverflow)
+		mark(p);
+	} IN {
+	} HANDLE CATCH(EOverflow) {
+		/* not undone until the handlers are done */
+		assert(v[0] == 10 && v[1] == 20);
+		RETHROW;
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		assert(ex_txn.used == 0 && ex_txn.depth == 0);
+		if (fail == 0) assert(v[0] == 10 && v[1] == 20 && v[2] == 30);
+		if (fail == 1) assert(v[0] == 10 && v[1] == 2 && v[2] == 3);
+		if (fail == 2) assert(v[0] == 1 && v[1] == 2 && v[2] == 3);
+	}
+	DONE;
+}
+
+static exc_type arena_inner(ex_arena *arena, int fail) {
+	THROWS(EOutOfMemory)
+	TRY_ARENA(arena, char *b; char *c) {
+		ARENA_ALLOC(b, 100)
+		ARENA_ALLOC(c, fail ? arena->cap : 1)
+	} IN {
+		assert(((size_t)b & (LIBEX_ARENA_ALIGN - 1)) == 0);
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static exc_type test_arena(int fail, int* p) {
+	THROWS(EOutOfMemory)
+	ex_arena arena;
+	size_t outer = 0;
+	ERROR(ex_arena_init(&arena, 1024));
+	TRY_ARENA(&arena, char *a) {
+		ARENA_ALLOC(a, 10)
+		outer = arena.used;
+		mark(p);
+	} IN {
+		exc_type e = arena_inner(&arena, fail);
+		/* the inner block rolled back its own allocations only */
+		assert(fail ? arena.used == outer : arena.used > outer);
+		ERROR(e);
+	} HANDLE CATCHANY {
+		assert(0);
+	} FINALLY {
+		/* kept on success, rolled back to empty on the way out otherwise */
+		assert(fail ? arena.used == 0 : arena.used > outer);
+		ex_arena_destroy(&arena);
+	}
+	DONE;
+}
+
+#ifndef _WIN32
+static atomic_int chunks_done[16];
+
+static exc_type test_chunk(void *ctx, size_t begin, size_t end) {
+	THROWS(EOverflow, EOutOfRange)
+	/* the pool has four threads */
+	assert(ex_parallel_slot < 4);
+	TRY() {
+		if (ctx != NULL && begin == 30) THROW(EOverflow)
+		if (ctx != NULL && begin == 70) THROW(EOutOfRange)
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		atomic_fetch_add(&chunks_done[begin / 10], 1);
+	}
+	DONE;
+}
+
+/* the first n chunks ran exactly k times */
+static int chunks_ran(int n, int k) {
+	int i;
+	for (i = 0; i < n; ++i) {
+		if (atomic_load(&chunks_done[i]) != k) return 0;
+	}
+	return 1;
+}
+
+static exc_type test_parallel_for(int fail) {
+	THROWS(EOverflow)
+	ex_pool pool;
+	TRY() {
+		ERROR(ex_pool_init(&pool, 4));
+	} IN {
+		ERROR(ex_parallel_for(&pool, 155, 10, test_chunk, fail ? &pool : NULL));
+	} HANDLE CATCHANY {
+		assert(0);
+	} FINALLY {
+		ex_pool_destroy(&pool);
+	}
+	DONE;
+}
+
+static exc_type task_ok(void *ctx) {
+	THROWS()
+	atomic_fetch_add((atomic_int*)ctx, 1);
+	DONE;
+}
+
+static exc_type task_fail(void *ctx) {
+	THROWS(EIOError)
+	atomic_fetch_add((atomic_int*)ctx, 1);
+	THROW(EIOError)
+	DONE;
+}
+
+static exc_type task_recover(void *ctx, exc_type e) {
+	THROWS()
+	assert(e == EIOError);
+	atomic_fetch_add((atomic_int*)ctx, 1);
+	DONE;
+}
+
+/* a -> b(fails) -> c(skipped) -> d(recovers); e and a -> f */
+static exc_type test_dag(atomic_int* p, ex_dag_report *report) {
+	THROWS(EIOError)
+	ex_pool pool;
+	ex_task t[6];
+	ex_task_init(&t[0], task_ok, NULL, p);
+	ex_task_init(&t[1], task_fail, NULL, p);
+	ex_task_init(&t[2], task_ok, NULL, p);
+	ex_task_init(&t[3], task_ok, task_recover, p);
+	ex_task_init(&t[4], task_ok, NULL, p);
+	ex_task_init(&t[5], task_ok, NULL, p);
+	TRY() {
+		ERROR(ex_pool_init(&pool, 3));
+		ERROR(ex_task_after(&t[1], &t[0]));
+		ERROR(ex_task_after(&t[2], &t[1]));
+		ERROR(ex_task_after(&t[3], &t[2]));
+		ERROR(ex_task_after(&t[5], &t[4]));
+		ERROR(ex_task_after(&t[5], &t[0]));
+	} IN {
+		ERROR(ex_dag_run(&pool, t, 6, report));
+	} HANDLE CATCHANY {
+		assert(0);
+	} FINALLY {
+		assert(t[3].result == ENoError && t[2].skipped);
+		ex_dag_destroy(t, 6);
+		ex_pool_destroy(&pool);
+	}
+	DONE;
+}
+
+/* a -> b -> c, with b also waiting on c, or on a task outside the graph */
+static exc_type test_dag_invalid(int cycle, atomic_int* p) {
+	THROWS(EDeadlock, EArgumentInvalid)
+	ex_pool pool;
+	ex_task t[3], outside;
+	ex_dag_report report;
+	ex_task_init(&t[0], task_ok, NULL, p);
+	ex_task_init(&t[1], task_ok, NULL, p);
+	ex_task_init(&t[2], task_ok, NULL, p);
+	ex_task_init(&outside, task_ok, NULL, p);
+	TRY() {
+		ERROR(ex_pool_init(&pool, 2));
+		ERROR(ex_task_after(&t[1], &t[0]));
+		ERROR(ex_task_after(&t[2], &t[1]));
+		ERROR(ex_task_after(&t[1], cycle ? &t[2] : &outside));
+	} IN {
+		ERROR(ex_dag_run(&pool, t, 3, &report));
+	} HANDLE CATCHANY {
+		assert(0);
+	} FINALLY {
+		ex_dag_destroy(t, 3);
+		ex_dag_destroy(&outside, 1);
+		ex_pool_destroy(&pool);
+	}
+	DONE;
+}
+
+static void *produce(void *arg) {
+	ex_future *f = (ex_future*)arg;
+	if (f->value.i == 0) {
+		PROMISE_FAIL(f, EIOError);
+	} else {
+		ex_value v;
+		v.i = f->value.i * 2;
+		ex_promise_resolve(f, v);
+	}
+	return NULL;
+}
+
+static exc_type test_future(intptr_t in, intptr_t *out) {
+	THROWS(EIOError)
+	ex_future f;
+	pthread_t producer;
+	int started = 0;
+	ex_future_init(&f);
+	f.value.i = in;
+	TRY(ex_value v) {
+		ERROR(pthread_create(&producer, NULL, produce, &f));
+		started = 1;
+		AWAIT(&f, v);
+		*out = v.i;
+	} IN {
+		assert(in != 0 && *out == in * 2);
+	} HANDLE CATCH(EIOError) {
+		assert(in == 0 && f.ctx.exc == EIOError && f.ctx.line > 0);
+		RETHROW;
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		if (started) pthread_join(producer, NULL);
+	}
+	DONE;
+}
+
+/* failing with ENoError must not complete the future with no value */
+static exc_type test_future_no_error(void) {
+	THROWS(EArgumentInvalid)
+	ex_future f;
+	ex_value v;
+	ex_future_init(&f);
+	PROMISE_FAIL(&f, ENoError);
+	assert(ex_future_ready(&f));
+	ERROR(ex_future_wait(&f, &v));
+	DONE;
+}
+static int conns_created, conns_destroyed;
+
+static exc_type conn_create(void *ctx, void **obj) {
+	THROWS(EOutOfMemory)
+	MAYBE(*obj = malloc(sizeof(int)), EOutOfMemory);
+	++conns_created;
+#ifdef LIBEX_CANCEL
+	/* canceled while connecting */
+	if (ctx != NULL) ex_cancel((ex_cancel_token*)ctx);
+#endif
+	DONE;
+}
+
+static void conn_destroy(void *ctx, void *obj) {
+	free(obj);
+	++conns_destroyed;
+}
+
+static exc_type use_conn(ex_objpool *pool, int reset, int* p) {
+	THROWS(EConnectionReset, EResourceUnavailable)
+	int *conn = NULL;
+	TRY_POOL(conn, pool, ) {
+		if (reset) THROW(EConnectionReset)
+	} IN {
+		assert(conn != NULL);
+	} HANDLE CATCH(EConnectionReset) {
+		POOL_DISCARD;
+		mark(p);
+		RETHROW;
+	} CATCH(EResourceUnavailable) {
+		mark(p);
+		RETHROW;
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+	}
+	DONE;
+}
+
+static exc_type test_pool(int* p) {
+	THROWS(EOutOfMemory)
+	ex_objpool pool;
+	void *a, *b;
+	conns_created = conns_destroyed = 0;
+	ERROR(ex_objpool_init(&pool, 2, conn_create, conn_destroy, NULL));
+	assert(use_conn(&pool, 0, p) == ENoError && use_conn(&pool, 0, p) == ENoError);
+	assert(conns_created == 1);
+	/* a reset connection is destroyed rather than reused */
+	assert(use_conn(&pool, 1, p) == EConnectionReset && conns_destroyed == 1);
+	assert(use_conn(&pool, 0, p) == ENoError && conns_created == 2);
+	assert(ex_objpool_get(&pool, &a) == ENoError && ex_objpool_get(&pool, &b) == ENoError && a != b);
+	assert(use_conn(&pool, 0, p) == EResourceUnavailable);
+	ex_objpool_put(&pool, a);
+	ex_objpool_put(&pool, b);
+	ex_objpool_destroy(&pool);
+	assert(conns_destroyed == conns_created);
+	DONE;
+}
+
+#ifdef LIBEX_CANCEL
+/* a cancel arriving while an object is created leaks neither the object
+ * nor its place in the pool */
+static exc_type test_pool_cancel(void) {
+	THROWS(ECanceled)
+	ex_cancel_token tok = EX_CANCEL_TOKEN_INIT;
+	ex_objpool pool;
+	int *conn = NULL;
+	conns_created = conns_destroyed = 0;
+	ERROR(ex_objpool_init(&pool, 1, conn_create, conn_destroy, &tok));
+	TRY_CANCELABLE(&tok, ) {
+		TRY_POOL(conn, &pool, ) {
+		} IN {
+			assert(conn != NULL);
+		} HANDLE CATCHANY {
+			assert(0);
+		} FINALLY {
+		}
+		ENDTRY;
+		assert(0);
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		assert(pool.live == 1 && pool.nidle + ex_objpool_cache_for(&pool)->n == 1);
+		ex_objpool_destroy(&pool);
+		assert(conns_created == 1 && conns_destroyed == 1);
+	}
+	DONE;
+}
+#endif
+static exc_type test_reserve(exc_type e, int* p) {
+	THROWS(EOutOfMemory, EIOError)
+	TRY() {
+		THROW(e)
+	} IN {
+		assert(0);
+	} HANDLE CATCH(EOutOfMemory) {
+		char *a = (char*)HANDLER_ALLOC(100);
+		char *b = (char*)HANDLER_ALLOC(5000);
+		assert(ex_reserve_owns(a) && ((size_t)a & (LIBEX_RESERVE_ALIGN - 1)) == 0);
+		/* too big for the reserve */
+		assert(b != NULL && !ex_reserve_owns(b));
+		HANDLER_FREE(b);
+		HANDLER_FREE(a);
+		/* the reserve rewinds once nothing is live */
+		assert(atomic_load(&ex_reserve_state) == 0);
+		mark(p);
+		RETHROW;
+	} CATCHANY {
+		char *a = (char*)HANDLER_ALLOC(100);
+		assert(a != NULL && !ex_reserve_owns(a));
+		HANDLER_FREE(a);
+		mark(p);
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+static int file_says(const char *path, const char *text) {
+	char buf[32] = { 0 };
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return text == NULL;
+	fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	return text != NULL && strcmp(buf, text) == 0;
+}
+
+static exc_type test_file_txn(const char *path, const char *text, int fail, int* p) {
+	THROWS(EIOError)
+	int fd = -1;
+	TRY_FILE_TXN(fd, path, ) {
+		mark(p);
+	} IN {
+		ERRORE(write(fd, text, strlen(text)) != (ssize_t)strlen(text), errno);
+		if (fail) THROW(EIOError)
+	} HANDLE CATCHANY {
+		assert(0);
+	} FINALLY {
+		assert(fd == -1);
+	}
+	DONE;
+}
+static void *committer(void *arg) {
+	ex_group_commit *gc = (ex_group_commit*)arg;
+	return (void*)(intptr_t)ex_group_commit_sync(gc);
+}
+
+/* every committer sees the result of the sync covering it */
+static exc_type test_group_commit(int fd) {
+	THROWS(EBadDescriptor)
+	ex_group_commit gc;
+	pthread_t threads[4];
+	size_t i, started = 0;
+	ex_group_commit_init(&gc, fd);
+	TRY() {
+		for (i = 0; i < 4; ++i) {
+			ERROR(pthread_create(&threads[i], NULL, committer, &gc));
+			++started;
+		}
+		THROWONERROR;
+		ERROR(ex_group_commit_sync(&gc));
+	} IN {
+	} HANDLE CATCH(EBadDescriptor) {
+		assert(fd == -1);
+		RETHROW;
+	} CATCHANY {
+		assert(0);
+	} FINALLY {
+		for (i = 0; i < started; ++i) {
+			void *r;
+			pthread_join(threads[i], &r);
+			assert((exc_type)(intptr_t)r == (fd == -1 ? EBadDescriptor : ENoError));
+		}
+		ex_group_commit_destroy(&gc);
+	}
+	DONE;
+}
+#define TRANSFER (256 * 1024)
+
+/* a file of TRANSFER bytes counting up, positioned at its start */
+static int counting_file(void) {
+	FILE *f = tmpfile();
+	int fd = dup(fileno(f)), i;
+	for (i = 0; i < TRANSFER; ++i) fputc(i % 251, f);
+	fclose(f);
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+static int counts_up(int fd, size_t from, size_t n) {
+	unsigned char c;
+	for (; n > 0; --n, ++from) {
+		if (read(fd, &c, 1) != 1 || c != from % 251) return 0;
+	}
+	return 1;
+}
+
+/* copy a file into a pipe too small to hold it, resuming after every
+ * EWouldBlock, with a kernel path or with the read/write fallback */
+static exc_type test_transfer(int fallback, int* p) {
+	THROWS(EOutOfMemory)
+	int in = counting_file(), pipefd[2];
+	size_t done = 0, drained = 0;
+	ex_transfer_buf buf = EX_TRANSFER_BUF_INIT;
+	assert(pipe2(pipefd, O_NONBLOCK) == 0);
+	while (done < TRANSFER) {
+		size_t before = done;
+		TRY() {
+			if (fallback) {
+				ERROR(ex_transfer_copy(in, pipefd[1], TRANSFER, &done, &buf));
+			} else {
+				ERROR(ex_transfer(in, pipefd[1], TRANSFER, &done, &buf));
+			}
+		} IN {
+			assert(done == TRANSFER);
+		} HANDLE CATCH(EWouldBlock) {
+			/* the pipe filled up part way, and done says how far */
+			assert(done > before && done < TRANSFER);
+			mark(p);
+		} CATCHANY {
+			RETHROW;
+		} FINALLY {
+		}
+		ENDTRY;
+		assert(counts_up(pipefd[0], drained, done - drained));
+		drained = done;
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(in);
+	ex_transfer_buf_free(&buf);
+	DONE;
+}
+
+static exc_type test_transfer_file(void) {
+	THROWS(EOutOfMemory)
+	int in = counting_file(), out = fileno(tmpfile());
+	size_t done = 0;
+	ex_transfer_buf buf = EX_TRANSFER_BUF_INIT;
+	ERROR(ex_transfer(in, out, TRANSFER + 100, &done, &buf));
+	/* stops at end of input, with the kernel path */
+	assert(done == TRANSFER && buf.data == NULL);
+	lseek(out, 0, SEEK_SET);
+	assert(counts_up(out, 0, TRANSFER));
+	DONE;
+}
+/* copy a procfs file, which copy_file_range may report as empty */
+static exc_type test_transfer_proc(void) {
+	THROWS(EOutOfMemory)
+	int in = open("/proc/self/status", O_RDONLY | O_CLOEXEC), out = fileno(tmpfile());
+	size_t done = 0;
+	char line[5] = "";
+	ex_transfer_buf buf = EX_TRANSFER_BUF_INIT;
+	assert(in != -1);
+	ERROR(ex_transfer(in, out, TRANSFER, &done, &buf));
+	assert(done > 0 && done < TRANSFER);
+	assert(pread(out, line, 4, 0) == 4 && strcmp(line, "Name") == 0);
+	close(in);
+	ex_transfer_buf_free(&buf);
+	DONE;
+}
+
+/* scan a mapped file, truncating it part way through the scan when cut is
+ * set, which must raise EIOError in the block rather than kill us */
+static exc_type test_mapped(int cut, int* p) {
+	THROWS(EOutOfMemory)
+	char path[] = "/tmp/libex-mapped.XXXXXX";
+	int fd = mkstemp(path);
+	/* i changes between the sigsetjmp and the fault, so it must not live
+	 * in a register the jump back restores */
+	volatile size_t scanned = 0, i;
+	const unsigned char *data = NULL;
+	size_t len = 0;
+	assert(fd != -1);
+	for (i = 0; i < 4 * 4096; ++i) assert(write(fd, "m", 1) == 1);
+	TRY_MAPPED(data, len, path, ) {
+	} IN {
+		assert(len == 4 * 4096 && ex_signal_top != NULL);
+		for (i = 0; i < len; i += 4096) {
+			if (cut && i == 4096) assert(ftruncate(fd, 0) == 0);
+			assert(data[i] == 'm');
+			scanned = i + 1;
+		}
+	} HANDLE CATCH(EIOError) {
+		/* the first page was read before the cut, the second faulted */
+		assert(cut && scanned == 1);
+		mark(p);
+	} CATCHANY {
+		RETHROW;
+	} FINALLY {
+		assert(ex_signal_top == NULL);
+		close(fd);
+		unlink(path);
+	}
+	assert(cut || scanned == 3 * 4096 + 1);
+	DONE;
+}
+/* divide by zero, or read a page that is not there, inside a guarded block */
+static exc_type test_guarded(int fault, int* p) {
+	THROWS(EOutOfMemory)
+	volatile int zero = 0, quotient = 0;
+	long page = sysconf(_SC_PAGESIZE);
+	char *hole = (char*)mmap(NULL, page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(hole != MAP_FAILED);
+	TRY_GUARDED(hole, page, ) {
+	} IN {
+		/* gcc computes 1 / x without dividing, so nothing would trap */
+		if (fault == 1) quotient = 7 / zero;
+		if (fault == 2) quotient = *(volatile char*)(hole + 7);
+		quotient = 1;
+	} HANDLE CATCH(EOutOfRange) {
+		assert(fault == 1 && quotient == 0);
+		mark(p);
+	} CATCH(EBadAddress) {
+		assert(fault == 2 && quotient == 0);
+		mark(p);
+	} CATCHANY {
+		RETHROW;
+	} FINALLY {
+		assert(ex_signal_top == NULL);
+		munmap(hole, page);
+	}
+	assert(fault || quotient == 1);
+	DONE;
+}
+/* append lines of text, and one write bigger than the buffer */
+static exc_type write_lines(ex_writer *w, int fd, int lines) {
+	THROWS(EOutOfMemory)
+	static char big[LIBEX_WRITER_BUF + 100];
+	int i;
+	TRY_WRITER(*w, fd, ) {
+	} IN {
+		for (i = 0; i < lines; ++i) {
+			ERROR(ex_write(w, "line\n", 5));
+		}
+		/* nothing written until the buffer fills */
+		assert(w->committed == 0 && w->used == 5 * (size_t)lines);
+		memset(big, 'b', sizeof(big));
+		ERROR(ex_write(w, big, sizeof(big)));
+		assert(w->committed == 5 * (size_t)lines + sizeof(big) && w->used == 0);
+		ERROR(ex_write(w, "end\n", 4));
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static exc_type test_writer(int broken, int* p) {
+	THROWS(EOutOfMemory)
+	int fds[2];
+	ex_writer w;
+	char got[6];
+	assert(pipe(fds) == 0);
+	if (broken) close(fds[0]);
+	TRY() {
+		ERROR(write_lines(&w, fds[1], 10));
+	} IN {
+		/* the final flush wrote the rest */
+		assert(!broken && w.used == 0 && w.committed == 50 + LIBEX_WRITER_BUF + 100 + 4);
+		assert(read(fds[0], got, 5) == 5 && memcmp(got, "line\n", 5) == 0);
+	} HANDLE CATCH(EBrokenPipe) {
+		/* the first write failed, with everything still buffered */
+		assert(broken && w.committed == 0 && w.used == 50);
+		mark(p);
+	} CATCHANY {
+		RETHROW;
+	} FINALLY {
+		if (!broken) close(fds[0]);
+		close(fds[1]);
+	}
+	DONE;
+}
+/* send four datagrams over loopback, two of which the kernel rejects, then
+ * receive the two that went into buffers too small for one of them */
+static exc_type test_batch(int* p) {
+	THROWS(EOutOfMemory)
+	static char big[70000];
+	int tx = socket(AF_INET, SOCK_DGRAM, 0), rx = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in to;
+	socklen_t len = sizeof(to);
+	struct mmsghdr msgs[4];
+	struct iovec iov[4];
+	char bufs[4][4];
+	const char *data[4] = { "a", "bad address", big, "dddddddd" };
+	size_t sizes[4] = { 1, 11, sizeof(big), 8 };
+	ex_batch batch;
+	unsigned i;
+	assert(tx != -1 && rx != -1);
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(rx, (struct sockaddr*)&to, sizeof(to)) == 0);
+	assert(getsockname(rx, (struct sockaddr*)&to, &len) == 0);
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < 4; ++i) {
+		iov[i].iov_base = (void*)data[i];
+		iov[i].iov_len = sizes[i];
+		msgs[i].msg_hdr.msg_name = &to;
+		msgs[i].msg_hdr.msg_namelen = i == 1 ? 3 : sizeof(to);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	ERROR(ex_sendmmsg(tx, msgs, 4, 0, &batch));
+	assert(batch.count == 4 && batch.failed == 2 && batch.ok[0] == 9);
+	FOR_EACH_FAILED(j, batch) {
+		assert((j == 1 && batch.err[j] == EArgumentInvalid) || (j == 2 && batch.err[j] == EMessageTooBig));
+		mark(p);
+	}
+	for (i = 0; i < 4; ++i) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_name = NULL;
+		msgs[i].msg_hdr.msg_namelen = 0;
+	}
+	ERROR(ex_recvmmsg(rx, msgs, 4, 0, &batch));
+	assert(batch.count == 2 && batch.failed == 1 && batch.ok[0] == 1);
+	assert(msgs[0].msg_len == 1 && bufs[0][0] == 'a');
+	FOR_EACH_FAILED(j, batch) {
+		assert(j == 1 && batch.err[j] == EMessageTooBig && memcmp(bufs[1], "dddd", 4) == 0);
+		mark(p);
+	}
+	/* with nothing left to receive the call itself fails */
+	assert(EWouldBlock == ex_recvmmsg(rx, msgs, 4, MSG_DONTWAIT, &batch));
+	close(tx);
+	close(rx);
+	DONE;
+}
+#define ECHOED (1024 * 1024)
+
+typedef struct echo_conn {
+	char buf[4096];
+	size_t head, tail;	/* bytes read but not yet echoed */
+	size_t sent, received;	/* the client's progress */
+	int shut;
+	exc_type closed;
+} echo_conn;
+
+/* echo until the peer shuts down, raising EWouldBlock when stuck */
+static exc_type echo_some(int fd, echo_conn *c) {
+	THROWS(EWouldBlock)
+	for (;;) {
+		ssize_t n;
+		if (c->head < c->tail) {
+			ERRORE(0 > (n = write(fd, c->buf + c->head, c->tail - c->head)), errno);
+			c->head += n;
+		} else {
+			ERRORE(0 > (n = read(fd, c->buf, sizeof(c->buf))), errno);
+			if (n == 0) RETURN;
+			c->head = 0;
+			c->tail = n;
+		}
+	}
+	THROWONERROR;
+	DONE;
+}
+
+static exc_type echo_run(ex_loop *loop, ex_watch *w) {
+	THROWS(EWouldBlock)
+	echo_conn *c = (echo_conn*)w->data;
+	TRY() {
+		ERROR(echo_some(w->fd, c));
+	} IN {
+	} HANDLE CATCH(EWouldBlock) {
+		WAIT_READY(w, c->head < c->tail ? EX_WRITABLE : EX_READABLE);
+	} CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+/* send ECHOED counting bytes and check they come back */
+static exc_type client_some(int fd, echo_conn *c) {
+	THROWS(EWouldBlock)
+	int progress = 1;
+	while (progress) {
+		ssize_t n, i;
+		progress = 0;
+		if (c->sent < ECHOED) {
+			for (i = 0; i < (ssize_t)sizeof(c->buf); ++i) c->buf[i] = (char)((c->sent + i) % 251);
+			n = write(fd, c->buf, ECHOED - c->sent < sizeof(c->buf) ? ECHOED - c->sent : sizeof(c->buf));
+			ERRORE(n < 0 && errno != EWouldBlock, errno);
+			if (n > 0) c->sent += n, progress = 1;
+		} else if (!c->shut) {
+			ERRORE(0 != shutdown(fd, SHUT_WR), errno);
+			c->shut = 1;
+		}
+		n = read(fd, c->buf, sizeof(c->buf));
+		ERRORE(n < 0 && errno != EWouldBlock, errno);
+		ERRORE(n == 0, EConnectionReset);
+		for (i = 0; i < n; ++i) {
+			if (c->buf[i] != (char)((c->received + i) % 251)) break;
+		}
+		ERRORE(i < n, EIOError);
+		if (n > 0) c->received += n, progress = 1;
+		if (c->received == ECHOED) RETURN;
+	}
+	THROWONERROR;
+	THROW(EWouldBlock)
+	DONE;
+}
+
+static exc_type client_run(ex_loop *loop, ex_watch *w) {
+	THROWS(EWouldBlock)
+	echo_conn *c = (echo_conn*)w->data;
+	TRY() {
+		ERROR(client_some(w->fd, c));
+	} IN {
+	} HANDLE CATCH(EWouldBlock) {
+		WAIT_READY(w, c->sent < ECHOED ? EX_READABLE | EX_WRITABLE : EX_READABLE);
+	} CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+static void echo_close(ex_loop *loop, ex_watch *w, exc_type e) {
+	((echo_conn*)w->data)->closed = e;
+	close(w->fd);
+}
+
+/* echo a megabyte through a socket pair, both ends driven by one loop */
+static exc_type test_loop(void) {
+	THROWS(EOutOfMemory)
+	static echo_conn server, client;
+	ex_watch ws, wc;
+	ex_loop loop;
+	int s[2];
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, s) == 0);
+	memset(&server, 0, sizeof(server));
+	memset(&client, 0, sizeof(client));
+	server.closed = client.closed = EEarlyReturn;
+	ERROR(ex_loop_init(&loop));
+	ex_watch_init(&ws, s[0], echo_run, echo_close, &server);
+	ex_watch_init(&wc, s[1], client_run, echo_close, &client);
+	ERROR(ex_loop_add(&loop, &ws));
+	ERROR(ex_loop_add(&loop, &wc));
+	ERROR(ex_loop_run(&loop));
+	assert(loop.live == 0 && server.closed == ENoError && client.closed == ENoError);
+	assert(client.sent == ECHOED && client.received == ECHOED);
+	ex_loop_destroy(&loop);
+	DONE;
+}
+
+typedef struct walk_stats {
+	atomic_int entries, denied, vanished, deep;
+	int strict;		/* abort on ETooManyLevels */
+} walk_stats;
+
+static exc_type walk_visit(void *ctx, const ex_walk_entry *e) {
+	THROWS(EIOError)
+	atomic_fetch_add(&((walk_stats*)ctx)->entries, 1);
+	if (strcmp(e->name, "y") == 0) assert(strcmp(e->path, "a/b/y") == 0 && e->depth == 3);
+	/* unlinked between being listed and being opened */
+	if (strcmp(e->name, "gone") == 0) assert(unlinkat(e->dirfd, e->name, AT_REMOVEDIR) == 0);
+	DONE;
+}
+
+static exc_type walk_policy(void *ctx, const ex_walk_entry *e, exc_type err) {
+	THROWS(...)
+	walk_stats *s = (walk_stats*)ctx;
+	TRY() {
+		ERROR(err);
+	} IN {
+		assert(0);
+	} HANDLE CATCH(EPermissionDenied) {
+		assert(strcmp(e->path, "d") == 0);
+		atomic_fetch_add(&s->denied, 1);
+	} CATCH(EPathNotFound) {
+		assert(strcmp(e->path, "gone") == 0);
+		atomic_fetch_add(&s->vanished, 1);
+	} CATCH(ETooManyLevels) {
+		assert(strcmp(e->path, "a/b/deep") == 0);
+		if (s->strict) RETHROW;
+		atomic_fetch_add(&s->deep, 1);
+	} CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+/* a/{x,b/{y,deep/f}}, c, d/e unreadable, and gone, removed as it is visited;
+ * deep is one level too many for LIBEX_WALK_DEPTH */
+static const char *walk_dirs[] = { "a", "a/b", "a/b/deep", "d", "gone" };
+static const char *walk_files[] = { "a/x", "a/b/y", "a/b/deep/f", "c", "d/e" };
+
+static void walk_tree(const char *root) {
+	char path[128];
+	const char **dirs = walk_dirs, **files = walk_files;
+	int i;
+	for (i = 0; i < 5; ++i) {
+		snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+		assert(mkdir(path, 0755) == 0 || (errno == EEXIST && chmod(path, 0755) == 0));
+	}
+	for (i = 0; i < 5; ++i) {
+		snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+		assert(close(open(path, O_WRONLY | O_CREAT, 0644)) == 0);
+	}
+	snprintf(path, sizeof(path), "%s/d", root);
+	assert(chmod(path, 0) == 0);
+}
+
+static exc_type test_walk(const char *root, int parallel, walk_stats *s) {
+	THROWS(ETooManyLevels)
+	ex_pool pool;
+	walk_tree(root);
+	TRY() {
+		ERROR(ex_pool_init(&pool, 3));
+	} IN {
+		if (parallel) {
+			ERROR(ex_walk_parallel(&pool, root, walk_visit, walk_policy, s));
+		} else {
+			ERROR(ex_walk(root, walk_visit, walk_policy, s));
+		}
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		ex_pool_destroy(&pool);
+	}
+	DONE;
+}
+
+static void walk_untree(const char *root) {
+	char path[128];
+	int i;
+	snprintf(path, sizeof(path), "%s/d", root);
+	assert(chmod(path, 0755) == 0);
+	for (i = 0; i < 5; ++i) {
+		snprintf(path, sizeof(path), "%s/%s", root, walk_files[i]);
+		assert(unlink(path) == 0);
+	}
+	for (i = 4; i >= 0; --i) {
+		snprintf(path, sizeof(path), "%s/%s", root, walk_dirs[i]);
+		assert(rmdir(path) == 0 || errno == ENOENT);
+	}
+	assert(rmdir(root) == 0);
+}
+
+/* the unreadable directory is only skipped when we can not read it */
+static int walked(const walk_stats *s, int strict) {
+	int denied = geteuid() != 0;
+	if (strict) return s->deep == 0;
+	return s->entries == 8 + !denied && s->denied == denied && s->vanished == 1 && s->deep == 1;
+}
+/* spawn path, and check what comes of it: how = 0 reads the child's output
+ * and waits for it, 1 fails the block while the child runs */
+static exc_type test_spawn(const char *path, int how, int *p) {
+	THROWS(EPathNotFound, EPermissionDenied, EInvalidExecutable, EIOError)
+	char *argv[] = { (char*)path, "-c", how ? "exec sleep 10" : "echo spawned; exit 3", NULL }, out[16];
+	int pipefd[2], fds[3] = { -1, -1, -1 };
+	ex_child child;
+	ssize_t n;
+	assert(pipe2(pipefd, O_CLOEXEC) == 0);
+	fds[1] = pipefd[1];
+	TRY_SPAWN(child, path, argv, NULL, fds, ) {
+	} IN {
+		assert(child.pid > 0);
+		close(pipefd[1]);
+		pipefd[1] = -1;
+		if (how) THROW(EIOError)
+		n = read(pipefd[0], out, sizeof(out));
+		assert(n == 8 && memcmp(out, "spawned\n", 8) == 0);
+		ERROR(ex_child_wait(&child));
+		assert(WIFEXITED(child.status) && WEXITSTATUS(child.status) == 3);
+	} HANDLE CATCHANY {
+		/* the reason the child could not run */
+		mark(p);
+		RETHROW;
+	} FINALLY {
+		/* reaped, killed if the block failed */
+		assert(child.pid == -1);
+		assert(!how || (WIFSIGNALED(child.status) && WTERMSIG(child.status) == SIGKILL));
+		if (pipefd[1] != -1) close(pipefd[1]);
+		close(pipefd[0]);
+	}
+	DONE;
+}
+
+#ifdef LIBEX_DEADLINE
+/* a deadline passing while a child runs, in a block that fails or succeeds,
+ * still reaps the child when the block exits */
+static exc_type test_spawn_deadline(int fail, int *p) {
+	THROWS(ETimedout)
+	char *argv[] = { "/bin/sh", "-c", fail ? "exec sleep 10" : "exit 0", NULL };
+	ex_child child;
+	TRY_DEADLINE(1000000, ) {
+		TRY_SPAWN(child, argv[0], argv, NULL, NULL, ) {
+		} IN {
+			while (!ex_deadline_expired());
+			if (fail) {
+				ERROR(ENoError);
+				assert(0);
+			}
+		} HANDLE CATCHANY {
+			assert(0);
+		} FINALLY {
+			assert(child.pid == -1);
+			assert(fail ? WIFSIGNALED(child.status) : WIFEXITED(child.status));
+			mark(p);
+		}
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+
+/* a deadline passing before a writer's block exits, in a block that fails or
+ * succeeds, neither fails the flush nor replaces the block's exception */
+static exc_type test_writer_deadline(int fail, int *p) {
+	THROWS(EIOError)
+	int fds[2];
+	ex_writer w;
+	char got[5];
+	assert(pipe(fds) == 0);
+	TRY_DEADLINE(1000000, ) {
+		TRY_WRITER(w, fds[1], ) {
+		} IN {
+			ERROR(ex_write(&w, "line\n", 5));
+			while (!ex_deadline_expired());
+			if (fail) {
+				ERROR(EIOError);
+			}
+		} HANDLE CATCHANY {
+			assert(0);
+		} FINALLY {
+			assert(w.used == 0 && w.committed == 5);
+			assert(read(fds[0], got, 5) == 5 && memcmp(got, "line\n", 5) == 0);
+			mark(p);
+		}
+	} IN {
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		close(fds[0]);
+		close(fds[1]);
+	}
+	DONE;
+}
+
+/* a dependency added under an expired deadline is recorded before the
+ * deadline is raised, so destroying the tasks frees each array once */
+static exc_type test_dag_deadline(int *p) {
+	THROWS(ETimedout)
+	ex_task t[2];
+	ex_task_init(&t[0], task_ok, NULL, NULL);
+	ex_task_init(&t[1], task_ok, NULL, NULL);
+	TRY_DEADLINE(0, ) {
+	} IN {
+		ERROR(ex_task_after(&t[1], &t[0]));
+		assert(0);
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		assert(t[0].ndependents == 1 && t[0].dependents[0] == &t[1]);
+		ex_dag_destroy(t, 2);
+		mark(p);
+	}
+	DONE;
+}
+
+/* a watch added under an expired deadline is counted before the deadline is
+ * raised, since epoll already holds it */
+static exc_type test_loop_deadline(int *p) {
+	THROWS(ETimedout)
+	ex_loop loop;
+	ex_watch w;
+	int fds[2];
+	assert(pipe(fds) == 0);
+	ERROR(ex_loop_init(&loop));
+	ex_watch_init(&w, fds[0], NULL, NULL, NULL);
+	TRY_DEADLINE(0, ) {
+	} IN {
+		ERROR(ex_loop_add(&loop, &w));
+		assert(0);
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+		assert(loop.live == 1);
+		ex_loop_destroy(&loop);
+		close(fds[0]);
+		close(fds[1]);
+		mark(p);
+	}
+	DONE;
+}
+
+/* an arena allocated under an expired deadline is handed to the caller, who
+ * is the one to raise the deadline */
+static exc_type test_arena_deadline(int *p) {
+	THROWS(ETimedout)
+	ex_arena a;
+	TRY_DEADLINE(0, ) {
+	} IN {
+		assert(ENoError == ex_arena_init(&a, 64));
+		ex_arena_destroy(&a);
+		mark(p);
+		ERROR(ENoError);
+	} HANDLE CATCHANY {
+		RETHROW;
+	} FINALLY {
+	}
+	DONE;
+}
+#endif
+
+/* a file that can not be executed, for mode */
+static void unrunnable(char *path, mode_t mode) {
+	int fd = mkstemp(path);
+	assert(fd != -1 && write(fd, "\x7f" "ELF garbage", 12) == 12 && fchmod(fd, mode) == 0);
+	close(fd);
+}
+#endif
+
 #define run_test(E) p = 0; assert(E)
 
 int main(char ** argv, size_t argc) {
@@ -131,5 +1603,130 @@ int main(char ** argv, size_t argc) {
 	run_test(EUnrecoverable == test_errno(EUnrecoverable));
 	run_test(EUnrecoverable == test_maybe(NULL, &p));
 	run_test(ENoError == test_maybe(&p, &p));
+#ifdef LIBEX_DEADLINE
+	run_test(ETimedout == test_deadline(&p) && p == 5);
+	run_test(ENoError == test_deadline_once(&p) && p == 4);
+#endif
+#ifdef LIBEX_CANCEL
+	run_test(ECanceled == test_cancel(&p) && p == 5);
+	run_test(ENoError == test_cancel_once(&p) && p == 4);
+#endif
+	run_test(ENoError == test_defer(3, &p) && p == 2);
+	run_test(EOutOfMemory == test_defer(2, &p) && p == 2);
+	run_test(ENoError == test_each(5, &p) && p == 1);
+	run_test(EDescriptorTooBig == test_each(3, &p) && p == 1);
+	run_test(ENoError == test_group(100, &p) && p == 1);
+	run_test(EOutOfMemory == test_group(SIZE_MAX / 2, &p) && p == 1);
+	run_test(EOutOfMemory == test_group(SIZE_MAX - 8, &p) && p == 1);
+	run_test(ENoError == test_scratch(100, &p) && p == 1);
+	run_test(ENoError == test_scratch(LIBEX_SCRATCH_SIZE + 1, &p) && p == 1);
+	run_test(EOutOfMemory == test_scratch(SIZE_MAX, &p) && p == 1);
+	assert(ENoError == ex_reclaim_register(drop_cache, NULL, 5) && ENoError == ex_reclaim_register(drop_index, NULL, 1));
+	cache_bytes = 10;
+	run_test(ENoError == test_reclaim(8, &p) && p == 1);
+	assert(nreclaims == 2 && reclaim_order[0] == 'i' && reclaim_order[1] == 'c');
+	run_test(EOutOfMemory == test_reclaim(8, &p) && p == 1 && nreclaims == 4);
+	cache_bytes = 6;
+	assert(ex_reclaim(0) == 6 && heap_budget == 8);
+	run_test(ENoError == test_txn(0, &p) && p == 1);
+	run_test(ENoError == test_txn(1, &p) && p == 1);
+	run_test(EOverflow == test_txn(2, &p) && p == 0);
+	ex_txn_release();
+	run_test(ENoError == test_arena(0, &p) && p == 1);
+	run_test(EOutOfMemory == test_arena(1, &p) && p == 1);
+#ifndef _WIN32
+	run_test(ENoError == test_parallel_for(0) && chunks_ran(16, 1));
+	run_test(EOverflow == test_parallel_for(1) && chunks_ran(4, 2));
+	{
+		ex_dag_report report = { NULL, 0, 0 };
+		atomic_int ran = 0;
+		run_test(EIOError == test_dag(&ran, &report) && ran == 5);
+		assert(report.failed == 2 && report.skipped == 1);
+		ran = 0;
+		run_test(EDeadlock == test_dag_invalid(1, &ran) && ran == 0);
+		run_test(EArgumentInvalid == test_dag_invalid(0, &ran) && ran == 0);
+	}
+	{
+		intptr_t out = 0;
+		run_test(ENoError == test_future(21, &out) && out == 42);
+		run_test(EIOError == test_future(0, &out));
+		run_test(EArgumentInvalid == test_future_no_error());
+	}
+	run_test(ENoError == test_pool(&p) && p == 2);
+#ifdef LIBEX_CANCEL
+	run_test(ECanceled == test_pool_cancel());
+#endif
+	assert(ENoError == ex_reserve_init(4096));
+	run_test(EOutOfMemory == test_reserve(EOutOfMemory, &p) && p == 1);
+	run_test(EIOError == test_reserve(EIOError, &p) && p == 1);
+	ex_reserve_destroy();
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/tmp/libex-file-txn.%ld", (long)getpid());
+		unlink(path);
+		run_test(EIOError == test_file_txn(path, "first", 1, &p) && p == 1 && file_says(path, NULL));
+		run_test(ENoError == test_file_txn(path, "first", 0, &p) && p == 1 && file_says(path, "first"));
+		run_test(EIOError == test_file_txn(path, "second", 1, &p) && p == 1 && file_says(path, "first"));
+		run_test(ENoError == test_file_txn(path, "second", 0, &p) && p == 1 && file_says(path, "second"));
+		unlink(path);
+	}
+	{
+		FILE *f = tmpfile();
+		run_test(ENoError == test_group_commit(fileno(f)));
+		run_test(EBadDescriptor == test_group_commit(-1));
+		fclose(f);
+	}
+	run_test(ENoError == test_transfer(0, &p) && p > 0);
+	run_test(ENoError == test_transfer(1, &p) && p > 0);
+	run_test(ENoError == test_transfer_file());
+	run_test(ENoError == test_transfer_proc());
+	run_test(ENoError == test_mapped(0, &p) && p == 0);
+	run_test(ENoError == test_mapped(1, &p) && p > 0);
+	run_test(ENoError == test_mapped(1, &p) && p > 0);
+	run_test(ENoError == test_guarded(0, &p) && p == 0);
+	run_test(ENoError == test_guarded(1, &p) && p > 0);
+	run_test(ENoError == test_guarded(2, &p) && p > 0);
+	run_test(ENoError == test_guarded(1, &p) && p > 0);
+	signal(SIGPIPE, SIG_IGN);
+	run_test(ENoError == test_writer(0, &p) && p == 0);
+	run_test(ENoError == test_writer(1, &p) && p > 0);
+	run_test(ENoError == test_batch(&p) && p == 3);
+	run_test(ENoError == test_loop());
+	{
+		char root[] = "/tmp/libex-walk.XXXXXX";
+		walk_stats s;
+		int parallel;
+		assert(mkdtemp(root) != NULL);
+		for (parallel = 0; parallel < 2; ++parallel) {
+			memset(&s, 0, sizeof(s));
+			run_test(ENoError == test_walk(root, parallel, &s) && walked(&s, 0));
+			memset(&s, 0, sizeof(s));
+			s.strict = 1;
+			run_test(ETooManyLevels == test_walk(root, parallel, &s) && walked(&s, 1));
+		}
+		walk_untree(root);
+	}
+	run_test(ENoError == test_spawn("/bin/sh", 0, &p) && p == 0);
+	run_test(EIOError == test_spawn("/bin/sh", 1, &p) && p == 0);
+	run_test(EPathNotFound == test_spawn("/nonexistent/sh", 0, &p) && p == 1);
+#ifdef LIBEX_DEADLINE
+	run_test(ETimedout == test_spawn_deadline(1, &p) && p == 1);
+	run_test(ENoError == test_spawn_deadline(0, &p) && p == 1);
+	run_test(EIOError == test_writer_deadline(1, &p) && p == 1);
+	run_test(ENoError == test_writer_deadline(0, &p) && p == 1);
+	run_test(ETimedout == test_dag_deadline(&p) && p == 1);
+	run_test(ETimedout == test_loop_deadline(&p) && p == 1);
+	run_test(ETimedout == test_arena_deadline(&p) && p == 1);
+#endif
+	{
+		char data[] = "/tmp/libex-spawn.XXXXXX", garbage[] = "/tmp/libex-spawn.XXXXXX";
+		unrunnable(data, 0644);
+		unrunnable(garbage, 0755);
+		run_test(EPermissionDenied == test_spawn(data, 0, &p) && p == 1);
+		run_test(EInvalidExecutable == test_spawn(garbage, 0, &p) && p == 1);
+		unlink(data);
+		unlink(garbage);
+	}
+#endif
 	return 0;
 }